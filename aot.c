@@ -0,0 +1,96 @@
+#include <dlfcn.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aot.h"
+#include "instructions.h"
+#include "spin.h"
+
+static const AotBlock** aot_table;
+static uint32_t aot_mask;
+
+// Stack accesses in translated code, through the TLB like the handlers'.
+static uint32_t aot_read32(Emulator* emu, uint32_t address) {
+    return get_memory32(emu, address);
+}
+
+static void aot_write32(Emulator* emu, uint32_t address, uint32_t value) {
+    set_memory32(emu, address, value);
+}
+
+static const AotServices aot_services = {instructions, aot_read32, aot_write32, spin_check};
+
+static uint32_t aot_slot(uint32_t eip) {
+    return (eip * 2654435761u) & aot_mask;
+}
+
+int aot_load(const char* path, uint32_t image_hash) {
+    // Without a slash dlopen searches the library path, not the current directory.
+    char local[PATH_MAX];
+    const char* file = path;
+    if (strchr(path, '/') == NULL) {
+        snprintf(local, sizeof(local), "./%s", path);
+        file = local;
+    }
+
+    void* handle = dlopen(file, RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL) {
+        printf("Cannot load %s: %s\n", path, dlerror());
+        return 0;
+    }
+
+    void (*bind)(const AotServices*) = (void (*)(const AotServices*)) dlsym(handle, "k86_aot_bind");
+    const uint32_t* hash = dlsym(handle, "k86_aot_image_hash");
+    const AotBlock* blocks = dlsym(handle, "k86_aot_blocks");
+    const uint32_t* count = dlsym(handle, "k86_aot_block_count");
+    if (bind == NULL || hash == NULL || blocks == NULL || count == NULL) {
+        printf("%s is not a k86-aot object\n", path);
+        dlclose(handle);
+        return 0;
+    }
+    if (*hash != image_hash) {
+        printf("%s was translated from another image, ignored\n", path);
+        dlclose(handle);
+        return 0;
+    }
+
+    uint32_t size = 1;
+    while (size < *count * 2) {
+        size <<= 1;
+    }
+    aot_table = calloc(size, sizeof(AotBlock*));
+    aot_mask = size - 1;
+    for (uint32_t i = 0; i < *count; i++) {
+        uint32_t slot = aot_slot(blocks[i].eip);
+        while (aot_table[slot] != NULL) {
+            slot = (slot + 1) & aot_mask;
+        }
+        aot_table[slot] = &blocks[i];
+    }
+
+    bind(&aot_services);
+    return 1;
+}
+
+// Returns the block at EIP if guest memory there still holds the bytes it was
+// translated from; stores and paging can both change what EIP points to.
+const AotBlock* aot_lookup(Emulator* emu) {
+    if (aot_table == NULL) {
+        return NULL;
+    }
+    for (uint32_t slot = aot_slot(emu->eip);; slot = (slot + 1) & aot_mask) {
+        const AotBlock* block = aot_table[slot];
+        if (block == NULL) {
+            return NULL;
+        }
+        if (block->eip == emu->eip) {
+            if (!within_page(block->eip, block->length)
+                || memcmp(translate(emu, block->eip, ACCESS_FETCH), block->code, block->length) != 0) {
+                return NULL;
+            }
+            return block;
+        }
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef K86_AOT_H
+#define K86_AOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct Emulator;
+
+// Layout shared with the C emitted by k86-aot. code holds the length bytes the
+// block was translated from, all within one page.
+typedef struct {
+    uint32_t eip;
+    uint32_t count;
+    uint32_t length;
+    const uint8_t* code;
+    void (*run)(struct Emulator*);
+} AotBlock;
+
+// What translated code calls back into, handed to it by k86_aot_bind. Layout
+// shared with the C emitted by k86-aot.
+typedef struct {
+    void (**instructions)(struct Emulator*);
+    uint32_t (*read32)(struct Emulator*, uint32_t);
+    void (*write32)(struct Emulator*, uint32_t, uint32_t);
+    void (*spin_check)(struct Emulator*, uint32_t);
+} AotServices;
+
+// FNV-1a, so that a translated object is never run against another image.
+static uint32_t aot_image_hash(const uint8_t* image, size_t size) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ image[i]) * 16777619u;
+    }
+    return hash;
+}
+
+int aot_load(const char* path, uint32_t image_hash);
+const AotBlock* aot_lookup(struct Emulator* emu);
+
+#endif //K86_AOT_H
@@ -8,9 +8,9 @@
 
 static int bios_to_terminal[8] = {30, 34, 32, 36, 31, 35, 33, 37};
 
-static void put_string(const char* s, size_t n) {
+static void put_string(Emulator* emu, const char* s, size_t n) {
     for (size_t i = 0; i < n; i++) {
-        io_out8(0x03f8, s[i]);
+        io_out8(emu, 0x03f8, s[i]);
     }
 }
 
@@ -22,7 +22,7 @@ void bios_video_teletype(Emulator* emu) {
     int terminal_color = bios_to_terminal[color & 0x07];
     int brightness = (color & 0x08) ? 1 : 0;
     int len = sprintf(buf, "\x1b[%d;%dm%c\x1b[0m", brightness, terminal_color, ch);
-    put_string(buf, len);
+    put_string(emu, buf, len);
 }
 
 void bios_video(Emulator* emu) {
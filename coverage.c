@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+
+#include "coverage.h"
+#include "instructions.h"
+#include "opcodes.h"
+
+// Same map size, shared memory variable and descriptors as AFL, so an
+// unmodified afl-fuzz can drive k86 through its fork server.
+#define MAP_SIZE_POW2 16
+#define MAP_SIZE (1 << MAP_SIZE_POW2)
+#define SHM_ENV_VAR "__AFL_SHM_ID"
+#define FORKSRV_FD 198
+
+static uint8_t* coverage_map;
+static instruction_func_t* uncovered[256];
+
+static uint32_t location(uint32_t eip) {
+    return (eip * 2654435761u) >> (32 - MAP_SIZE_POW2);
+}
+
+// Only control transfers are wrapped, so straight-line code runs the plain
+// handlers.
+static void covered(Emulator* emu) {
+    uint32_t from = emu->eip;
+    uncovered[get_code8(emu, 0)](emu);
+    coverage_map[(location(from) >> 1) ^ location(emu->eip)]++;
+}
+
+int coverage_init(void) {
+    const char* id = getenv(SHM_ENV_VAR);
+    if (id == NULL) {
+        coverage_map = calloc(MAP_SIZE, 1);
+        return 1;
+    }
+
+    void* map = shmat(atoi(id), NULL, 0);
+    if (map == (void*) -1) {
+        printf("Cannot attach coverage map %s\n", id);
+        return 0;
+    }
+    coverage_map = map;
+    return 1;
+}
+
+void coverage_instrument(void) {
+    for (int code = 0; code < 256; code++) {
+        int flow = opcode_info[code].flow;
+        if (flow == FLOW_UNKNOWN || flow == FLOW_NEXT) {
+            continue;
+        }
+        if (instructions[code] != NULL && instructions[code] != covered) {
+            uncovered[code] = instructions[code];
+            instructions[code] = covered;
+        }
+    }
+}
+
+// Returns in a fresh child for every run requested by the fuzzer, or at once
+// when nothing is listening on the fork server descriptors.
+void coverage_fork_server(void) {
+    uint32_t message = 0;
+    if (write(FORKSRV_FD + 1, &message, 4) != 4) {
+        return;
+    }
+
+    for (;;) {
+        if (read(FORKSRV_FD, &message, 4) != 4) {
+            exit(1);
+        }
+
+        pid_t child = fork();
+        if (child < 0) {
+            exit(1);
+        }
+        if (child == 0) {
+            close(FORKSRV_FD);
+            close(FORKSRV_FD + 1);
+            return;
+        }
+
+        int status;
+        if (write(FORKSRV_FD + 1, &child, 4) != 4 || waitpid(child, &status, 0) < 0) {
+            exit(1);
+        }
+        if (write(FORKSRV_FD + 1, &status, 4) != 4) {
+            exit(1);
+        }
+    }
+}
+
+// Called where the guest faults, before the emulator stops. In fuzz mode the
+// run aborts instead, since afl-fuzz only counts signals as crashes.
+void coverage_fault(void) {
+    if (coverage_map != NULL) {
+        fflush(stdout);
+        abort();
+    }
+}
@@ -0,0 +1,11 @@
+#ifndef K86_COVERAGE_H
+#define K86_COVERAGE_H
+
+#include "emulator.h"
+
+int coverage_init(void);
+void coverage_instrument(void);
+void coverage_fork_server(void);
+void coverage_fault(void);
+
+#endif //K86_COVERAGE_H
@@ -8,6 +8,9 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+
+#include "opcodes.h"
 
 static const int MEMORY_SIZE = 1024 * 1024;
 enum Register {
@@ -24,15 +27,88 @@ static char* register_names[] = {
 #define SIGN_FLAG (1 << 7)
 #define OVERFLOW_FLAG (1 << 11)
 
+#define CR0_PE (1)
+#define CR0_WP (1 << 16)
+#define CR0_PG (1u << 31)
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+#define PAGE_MASK (PAGE_SIZE - 1)
+#define TLB_SIZE 64
+
+enum Access {
+    ACCESS_READ, ACCESS_WRITE, ACCESS_FETCH, ACCESS_COUNT
+};
+
+#define SPIN_CACHE_SIZE 16
+
+// What analyse found for the loop closed by the short jump at branch.
+typedef struct {
+    uint32_t branch;
+    uint32_t head;
+    int kind;
+} SpinLoop;
+
+// Spin-loop detection: analyses per backward branch, direct-mapped on its
+// address so nested loops keep theirs, and the state at the last iteration
+// of the loop seen most recently.
 typedef struct {
+    SpinLoop loops[SPIN_CACHE_SIZE];
+    uint32_t branch;
+    uint64_t icount;
+    uint32_t registers[REGISTERS_COUNT];
+    uint32_t eflags;
+} SpinState;
+
+// The C emitted by k86-aot accesses the fields up to eip directly, so their
+// order is fixed.
+typedef struct Emulator {
     uint32_t registers[REGISTERS_COUNT];
     uint32_t eflags;
     uint8_t* memory;
     uint32_t eip;
+    uint64_t icount;
+    int cpu_id;
+
+    uint32_t cr0;
+    uint32_t cr2;
+    uint32_t cr3;
+
+    // Direct-mapped software TLB per access kind: guest page number to the
+    // host address of the page. translate skips it while paging is off.
+    uint32_t tlb_tag[ACCESS_COUNT][TLB_SIZE];
+    uint8_t* tlb_page[ACCESS_COUNT][TLB_SIZE];
+
+    SpinState spin;
+
+    // One flag per 4KiB page holding a gdb watchpoint, NULL when there is none.
+    uint8_t* watch_pages;
 } Emulator;
 
+void gdb_watch_store(Emulator* emu, uint32_t address);
+
+uint8_t* tlb_fill(Emulator* emu, uint32_t address, int access);
+void tlb_flush(Emulator* emu);
+
+static uint8_t* translate(Emulator* emu, uint32_t address, int access) {
+    if (!(emu->cr0 & CR0_PG) && address < MEMORY_SIZE) {
+        return emu->memory + address;
+    }
+
+    uint32_t page = address >> PAGE_SHIFT;
+    uint32_t index = page & (TLB_SIZE - 1);
+    if (emu->tlb_tag[access][index] == page) {
+        return emu->tlb_page[access][index] + (address & PAGE_MASK);
+    }
+    return tlb_fill(emu, address, access) + (address & PAGE_MASK);
+}
+
+static int within_page(uint32_t address, int size) {
+    return (address & PAGE_MASK) <= PAGE_SIZE - size;
+}
+
 static uint32_t get_code8(Emulator* emu, int index) {
-    return emu->memory[emu->eip + index];
+    return *translate(emu, emu->eip + index, ACCESS_FETCH);
 }
 
 static int32_t get_signed_code8(Emulator* emu, int index) {
@@ -40,6 +116,12 @@ static int32_t get_signed_code8(Emulator* emu, int index) {
 }
 
 static uint32_t get_code32(Emulator* emu, int index) {
+    uint32_t address = emu->eip + index;
+    if (within_page(address, 4)) {
+        uint8_t* p = translate(emu, address, ACCESS_FETCH);
+        return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+    }
+
     uint32_t ret = 0;
     for (int i = 0; i < 4; i++) {
         ret |= get_code8(emu, index + i) << (i * 8);
@@ -71,15 +153,24 @@ static void set_register8(Emulator* emu, int index, uint8_t value) {
     if (index < 4) {
         emu->registers[index] = (get_register32(emu, index) & 0xffffff00) | ((uint32_t) value);
     } else {
-        emu->registers[index - 4] = (get_register32(emu, index) & 0xffff00ff) | ((uint32_t) value << 8);
+        emu->registers[index - 4] = (get_register32(emu, index - 4) & 0xffff00ff) | ((uint32_t) value << 8);
     }
 }
 
 static uint32_t get_memory8(Emulator* emu, uint32_t address) {
-    return emu->memory[address];
+    return *translate(emu, address, ACCESS_READ);
 }
 
 static uint32_t get_memory32(Emulator* emu, uint32_t address) {
+    if (within_page(address, 4)) {
+        uint8_t* p = translate(emu, address, ACCESS_READ);
+        // Aligned loads are single accesses, so another vCPU never sees a torn value.
+        if ((address & 3) == 0) {
+            return __atomic_load_n((uint32_t*) p, __ATOMIC_RELAXED);
+        }
+        return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+    }
+
     uint32_t ret = 0;
     for(int i = 0; i < 4; i++) {
         ret |= get_memory8(emu, address + i) << (i * 8);
@@ -88,10 +179,26 @@ static uint32_t get_memory32(Emulator* emu, uint32_t address) {
 }
 
 static void set_memory8(Emulator* emu, uint32_t address, uint32_t value) {
-    emu->memory[address] = value & 0xFF;
+    *translate(emu, address, ACCESS_WRITE) = value & 0xFF;
+    if (emu->watch_pages != NULL && emu->watch_pages[address >> PAGE_SHIFT]) {
+        gdb_watch_store(emu, address);
+    }
 }
 
 static void set_memory32(Emulator* emu, uint32_t address, uint32_t value) {
+    if (within_page(address, 4) && emu->watch_pages == NULL) {
+        uint8_t* p = translate(emu, address, ACCESS_WRITE);
+        if ((address & 3) == 0) {
+            __atomic_store_n((uint32_t*) p, value, __ATOMIC_RELAXED);
+            return;
+        }
+        p[0] = value;
+        p[1] = value >> 8;
+        p[2] = value >> 16;
+        p[3] = value >> 24;
+        return;
+    }
+
     for (int i = 0; i < 4; i++) {
         set_memory8(emu, address + i, value >> (i * 8));
     }
@@ -158,15 +265,11 @@ static int is_overflow(Emulator* emu) {
     return (emu->eflags & OVERFLOW_FLAG) != 0;
 }
 
-static void update_eflags_sub(Emulator* emu, uint32_t v1, uint32_t v2, uint64_t result) {
-    int sign1 = v1 >> 31;
-    int sign2 = v2 >> 31;
-    int signr = (result >> 31) & 1;
-
-    set_carry(emu, result >> 32);
-    set_zero(emu, result == 0);
-    set_sign(emu, signr);
-    set_overflow(emu, sign1 != sign2 && sign1 != signr);
+// Sets CF, ZF, SF and OF in one store.
+static void update_eflags(Emulator* emu, int carry, int overflow, int zero, int sign) {
+    uint32_t flags = (carry ? CARRY_FLAG : 0) | (zero ? ZERO_FLAG : 0)
+                     | (sign ? SIGN_FLAG : 0) | (overflow ? OVERFLOW_FLAG : 0);
+    emu->eflags = (emu->eflags & ~(CARRY_FLAG | ZERO_FLAG | SIGN_FLAG | OVERFLOW_FLAG)) | flags;
 }
 
 static void dump_registers(Emulator* emu) {
@@ -174,21 +277,50 @@ static void dump_registers(Emulator* emu) {
         printf("%s = %08x\n", register_names[i], emu->registers[i]);
     }
 
-    printf("EIP = %08x\n", emu->eip);
+    char text[64];
+    disassemble_at(emu, emu->eip, text, sizeof(text));
+    printf("EIP = %08x: %s\n", emu->eip, text);
 }
 
 static Emulator* create_emulator(size_t size, uint32_t eip, uint32_t esp) {
     Emulator* emu = malloc(sizeof(Emulator));
     emu->memory = malloc(size);
     memset(emu->registers, 0, sizeof(emu->registers));
+    emu->eflags = 0;
     emu->eip = eip;
     emu->registers[ESP] = esp;
+    emu->icount = 0;
+    emu->cpu_id = 0;
+    emu->cr0 = emu->cr2 = emu->cr3 = 0;
+    tlb_flush(emu);
+    memset(&emu->spin, 0, sizeof(emu->spin));
+    emu->watch_pages = NULL;
+
+    return emu;
+}
+
+// Secondary CPUs share the memory of the bootstrap CPU.
+static Emulator* create_vcpu(Emulator* bsp, int cpu_id) {
+    Emulator* emu = malloc(sizeof(Emulator));
+    memset(emu->registers, 0, sizeof(emu->registers));
+    emu->eflags = 0;
+    emu->memory = bsp->memory;
+    emu->eip = 0;
+    emu->icount = 0;
+    emu->cpu_id = cpu_id;
+    emu->cr0 = emu->cr2 = emu->cr3 = 0;
+    tlb_flush(emu);
+    memset(&emu->spin, 0, sizeof(emu->spin));
+    emu->watch_pages = NULL;
 
     return emu;
 }
 
 static void destroy_emulator(Emulator* emu) {
-    free(emu->memory);
+    free(emu->watch_pages);
+    if (emu->cpu_id == 0) {
+        free(emu->memory);
+    }
     free(emu);
 }
 
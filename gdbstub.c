@@ -0,0 +1,570 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "gdbstub.h"
+#include "instructions.h"
+#include "paging.h"
+
+#define PACKET_SIZE 4096
+#define MAX_BREAKPOINTS 64
+#define MAX_WATCHPOINTS 16
+#define WATCH_PAGES (1 << (32 - PAGE_SHIFT))
+
+// eax, ecx, edx, ebx, esp, ebp, esi, edi, eip, eflags, cs, ss, ds, es, fs, gs
+#define GDB_REGISTERS 16
+#define GDB_EIP 8
+#define GDB_EFLAGS 9
+
+typedef struct {
+    uint32_t address;
+    uint8_t* host;
+    uint8_t saved;
+} Breakpoint;
+
+typedef struct {
+    uint32_t address;
+    uint32_t length;
+} Watchpoint;
+
+static int gdb_fd = -1;
+
+// Breakpoints are int3 bytes patched into guest memory while the guest runs,
+// so the dispatch loop itself never looks for them.
+static Breakpoint breakpoints[MAX_BREAKPOINTS];
+static int breakpoint_count;
+static int breakpoints_inserted;
+
+static Watchpoint watchpoints[MAX_WATCHPOINTS];
+static int watchpoint_count;
+static uint32_t watch_hit_address;
+
+// A watched store cannot stop mid-instruction, so every opcode is routed to
+// gdb_trap until the next dispatch.
+static instruction_func_t* trapped_instructions[256];
+static int trap_armed;
+
+static void gdb_int3(Emulator* emu);
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static int hex_value(char c) {
+    if ('0' <= c && c <= '9') return c - '0';
+    if ('a' <= c && c <= 'f') return c - 'a' + 10;
+    if ('A' <= c && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static uint32_t parse_hex(const char** p) {
+    uint32_t value = 0;
+    int digit;
+    while ((digit = hex_value(**p)) >= 0) {
+        value = (value << 4) | digit;
+        (*p)++;
+    }
+    return value;
+}
+
+static char* put_hex32(char* p, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        uint8_t byte = value >> (i * 8);
+        *p++ = hex_digits[byte >> 4];
+        *p++ = hex_digits[byte & 0x0f];
+    }
+    return p;
+}
+
+static uint32_t get_hex32(const char** p) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+        value |= (uint32_t) ((hex_value((*p)[0]) << 4) | hex_value((*p)[1])) << (i * 8);
+        *p += 2;
+    }
+    return value;
+}
+
+static int read_byte(void) {
+    uint8_t c;
+    if (recv(gdb_fd, &c, 1, 0) != 1) {
+        return -1;
+    }
+    return c;
+}
+
+static int read_packet(char* buf) {
+    for (;;) {
+        int c;
+        do {
+            c = read_byte();
+            if (c < 0) {
+                return -1;
+            }
+        } while (c != '$');
+
+        int length = 0;
+        uint8_t sum = 0;
+        while ((c = read_byte()) >= 0 && c != '#') {
+            if (length < PACKET_SIZE - 1) {
+                buf[length++] = c;
+            }
+            sum += c;
+        }
+        if (c < 0) {
+            return -1;
+        }
+        int high = read_byte();
+        int low = read_byte();
+        if (low < 0) {
+            return -1;
+        }
+        buf[length] = '\0';
+
+        if (((hex_value(high) << 4) | hex_value(low)) == sum) {
+            send(gdb_fd, "+", 1, 0);
+            return length;
+        }
+        send(gdb_fd, "-", 1, 0);
+    }
+}
+
+static void write_packet(const char* data) {
+    char buf[PACKET_SIZE + 4];
+    size_t length = strlen(data);
+    uint8_t sum = 0;
+
+    buf[0] = '$';
+    for (size_t i = 0; i < length; i++) {
+        buf[i + 1] = data[i];
+        sum += data[i];
+    }
+    buf[length + 1] = '#';
+    buf[length + 2] = hex_digits[sum >> 4];
+    buf[length + 3] = hex_digits[sum & 0x0f];
+
+    do {
+        send(gdb_fd, buf, length + 4, 0);
+    } while (read_byte() == '-');
+}
+
+static uint32_t get_gdb_register(Emulator* emu, int index) {
+    if (index < REGISTERS_COUNT) {
+        return get_register32(emu, index);
+    } else if (index == GDB_EIP) {
+        return emu->eip;
+    } else if (index == GDB_EFLAGS) {
+        return emu->eflags;
+    }
+    return 0;
+}
+
+static void set_gdb_register(Emulator* emu, int index, uint32_t value) {
+    if (index < REGISTERS_COUNT) {
+        set_register32(emu, index, value);
+    } else if (index == GDB_EIP) {
+        emu->eip = value;
+    } else if (index == GDB_EFLAGS) {
+        emu->eflags = value;
+    }
+}
+
+static void insert_breakpoints(Emulator* emu) {
+    for (int i = 0; i < breakpoint_count; i++) {
+        breakpoints[i].host = probe_memory(emu, breakpoints[i].address);
+        if (breakpoints[i].host != NULL) {
+            breakpoints[i].saved = *breakpoints[i].host;
+            *breakpoints[i].host = 0xCC;
+        }
+    }
+    breakpoints_inserted = 1;
+}
+
+static void remove_breakpoints(Emulator* emu) {
+    if (!breakpoints_inserted) {
+        return;
+    }
+    for (int i = breakpoint_count - 1; i >= 0; i--) {
+        if (breakpoints[i].host != NULL) {
+            *breakpoints[i].host = breakpoints[i].saved;
+        }
+    }
+    breakpoints_inserted = 0;
+}
+
+static int find_breakpoint(uint32_t address) {
+    for (int i = 0; i < breakpoint_count; i++) {
+        if (breakpoints[i].address == address) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void update_watch_pages(Emulator* emu) {
+    if (watchpoint_count == 0) {
+        free(emu->watch_pages);
+        emu->watch_pages = NULL;
+        return;
+    }
+    if (emu->watch_pages == NULL) {
+        emu->watch_pages = malloc(WATCH_PAGES);
+    }
+    memset(emu->watch_pages, 0, WATCH_PAGES);
+    for (int i = 0; i < watchpoint_count; i++) {
+        uint32_t first = watchpoints[i].address >> PAGE_SHIFT;
+        uint32_t last = (watchpoints[i].address + watchpoints[i].length - 1) >> PAGE_SHIFT;
+        for (uint32_t page = first; page <= last && page < WATCH_PAGES; page++) {
+            emu->watch_pages[page] = 1;
+        }
+    }
+}
+
+static int add_point(Emulator* emu, int type, uint32_t address, uint32_t length) {
+    if (type == 0 || type == 1) {
+        if (find_breakpoint(address) >= 0) {
+            return 1;
+        }
+        if (breakpoint_count == MAX_BREAKPOINTS) {
+            return 0;
+        }
+        breakpoints[breakpoint_count].address = address;
+        breakpoint_count++;
+        return 1;
+    } else if (type == 2) {
+        if (watchpoint_count == MAX_WATCHPOINTS) {
+            return 0;
+        }
+        watchpoints[watchpoint_count].address = address;
+        watchpoints[watchpoint_count].length = length ? length : 1;
+        watchpoint_count++;
+        update_watch_pages(emu);
+        return 1;
+    }
+    return -1;
+}
+
+static int remove_point(Emulator* emu, int type, uint32_t address, uint32_t length) {
+    if (type == 0 || type == 1) {
+        int i = find_breakpoint(address);
+        if (i >= 0) {
+            breakpoints[i] = breakpoints[--breakpoint_count];
+        }
+        return 1;
+    } else if (type == 2) {
+        for (int i = 0; i < watchpoint_count; i++) {
+            if (watchpoints[i].address == address && watchpoints[i].length == (length ? length : 1)) {
+                watchpoints[i] = watchpoints[--watchpoint_count];
+                break;
+            }
+        }
+        update_watch_pages(emu);
+        return 1;
+    }
+    return -1;
+}
+
+// Runs one instruction with breakpoints removed; returns 1 if it hit a
+// watchpoint or the guest's own int3.
+static int step(Emulator* emu) {
+    uint8_t code = get_code8(emu, 0);
+    if (trapped_instructions[code] != NULL) {
+        trapped_instructions[code](emu);
+    } else if (code == 0xCC) {
+        // There is no int3 handler to run; trap after it as gdb_int3 does.
+        emu->eip += 1;
+        return 1;
+    }
+    if (trap_armed) {
+        memcpy(instructions, trapped_instructions, sizeof(instructions));
+        instructions[0xCC] = gdb_int3;
+        trap_armed = 0;
+        return 1;
+    }
+    return 0;
+}
+
+static void report_stop(void) {
+    char buf[64];
+    if (watch_hit_address != UINT32_MAX) {
+        sprintf(buf, "T05watch:%x;", watch_hit_address);
+        watch_hit_address = UINT32_MAX;
+    } else {
+        sprintf(buf, "S05");
+    }
+    write_packet(buf);
+}
+
+// Talks to gdb until it resumes the guest. Returns with breakpoints inserted.
+// A stop reply is only sent when the guest stopped while gdb was waiting on
+// c or s; on attach gdb asks with ? itself.
+static void serve(Emulator* emu, int stopped) {
+    char packet[PACKET_SIZE];
+    char reply[PACKET_SIZE];
+
+    remove_breakpoints(emu);
+    if (stopped) {
+        report_stop();
+    }
+
+    while (read_packet(packet) >= 0) {
+        const char* p = packet + 1;
+        char* r = reply;
+        reply[0] = '\0';
+
+        switch (packet[0]) {
+            case '?':
+                strcpy(reply, "S05");
+                break;
+            case 'g':
+                for (int i = 0; i < GDB_REGISTERS; i++) {
+                    r = put_hex32(r, get_gdb_register(emu, i));
+                }
+                *r = '\0';
+                break;
+            case 'G':
+                for (int i = 0; i < GDB_REGISTERS && strlen(p) >= 8; i++) {
+                    set_gdb_register(emu, i, get_hex32(&p));
+                }
+                strcpy(reply, "OK");
+                break;
+            case 'p': {
+                int index = parse_hex(&p);
+                *put_hex32(reply, get_gdb_register(emu, index)) = '\0';
+                break;
+            }
+            case 'P': {
+                int index = parse_hex(&p);
+                p++;
+                set_gdb_register(emu, index, get_hex32(&p));
+                strcpy(reply, "OK");
+                break;
+            }
+            case 'm': {
+                uint32_t address = parse_hex(&p);
+                p++;
+                uint32_t length = parse_hex(&p);
+                if (length > (PACKET_SIZE - 1) / 2) {
+                    length = (PACKET_SIZE - 1) / 2;
+                }
+                for (uint32_t i = 0; i < length; i++) {
+                    uint8_t* byte = probe_memory(emu, address + i);
+                    if (byte == NULL) {
+                        break;
+                    }
+                    *r++ = hex_digits[*byte >> 4];
+                    *r++ = hex_digits[*byte & 0x0f];
+                }
+                *r = '\0';
+                if (r == reply) {
+                    strcpy(reply, "E14");
+                }
+                break;
+            }
+            case 'M': {
+                uint32_t address = parse_hex(&p);
+                p++;
+                uint32_t length = parse_hex(&p);
+                p++;
+                strcpy(reply, "OK");
+                for (uint32_t i = 0; i < length; i++, p += 2) {
+                    uint8_t* byte = probe_memory(emu, address + i);
+                    if (byte == NULL) {
+                        strcpy(reply, "E14");
+                        break;
+                    }
+                    *byte = (hex_value(p[0]) << 4) | hex_value(p[1]);
+                }
+                break;
+            }
+            case 'Z':
+            case 'z': {
+                int type = parse_hex(&p);
+                p++;
+                uint32_t address = parse_hex(&p);
+                p++;
+                uint32_t length = parse_hex(&p);
+                int ok = packet[0] == 'Z' ? add_point(emu, type, address, length)
+                                          : remove_point(emu, type, address, length);
+                if (ok > 0) {
+                    strcpy(reply, "OK");
+                } else if (ok == 0) {
+                    strcpy(reply, "E01");
+                }
+                break;
+            }
+            case 's':
+                if (*p) {
+                    emu->eip = parse_hex(&p);
+                }
+                step(emu);
+                if (emu->eip == 0x00) {
+                    gdb_exit(emu, 0);
+                    return;
+                }
+                report_stop();
+                continue;
+            case 'c':
+                if (*p) {
+                    emu->eip = parse_hex(&p);
+                }
+                if (find_breakpoint(emu->eip) >= 0 && step(emu)) {
+                    report_stop();
+                    continue;
+                }
+                insert_breakpoints(emu);
+                return;
+            case 'D':
+                write_packet("OK");
+                gdb_detach(emu);
+                return;
+            case 'k':
+                exit(0);
+            case 'H':
+                strcpy(reply, "OK");
+                break;
+            case 'q':
+                if (strncmp(packet, "qSupported", 10) == 0) {
+                    sprintf(reply, "PacketSize=%x", PACKET_SIZE);
+                } else if (strcmp(packet, "qAttached") == 0) {
+                    strcpy(reply, "1");
+                } else if (strcmp(packet, "qC") == 0) {
+                    strcpy(reply, "QC1");
+                }
+                break;
+        }
+        write_packet(reply);
+    }
+
+    gdb_detach(emu);
+}
+
+static void gdb_int3(Emulator* emu) {
+    if (find_breakpoint(emu->eip) < 0) {
+        // The guest's own int3 reports like a trap: after the instruction.
+        emu->eip += 1;
+    }
+    serve(emu, 1);
+}
+
+static void gdb_trap(Emulator* emu) {
+    memcpy(instructions, trapped_instructions, sizeof(instructions));
+    instructions[0xCC] = gdb_int3;
+    trap_armed = 0;
+    serve(emu, 1);
+}
+
+void gdb_watch_store(Emulator* emu, uint32_t address) {
+    if (gdb_fd < 0 || trap_armed) {
+        return;
+    }
+    for (int i = 0; i < watchpoint_count; i++) {
+        if (watchpoints[i].address <= address && address - watchpoints[i].address < watchpoints[i].length) {
+            watch_hit_address = watchpoints[i].address;
+            for (int code = 0; code < 256; code++) {
+                instructions[code] = gdb_trap;
+            }
+            trap_armed = 1;
+            return;
+        }
+    }
+}
+
+static int listen_tcp(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int listen_unix(const char* path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// A plain number is a TCP port on localhost, anything else a Unix socket path.
+int gdb_open(const char* address) {
+    int port = atoi(address);
+    int fd = strspn(address, "0123456789") == strlen(address) ? listen_tcp(port) : listen_unix(address);
+    if (fd < 0 || listen(fd, 1) < 0) {
+        printf("Cannot listen on %s\n", address);
+        return 0;
+    }
+
+    printf("Waiting for gdb on %s\n", address);
+    gdb_fd = accept(fd, NULL, NULL);
+    close(fd);
+    if (gdb_fd < 0) {
+        printf("Cannot accept gdb connection\n");
+        return 0;
+    }
+    return 1;
+}
+
+void gdb_attach(Emulator* emu) {
+    if (gdb_fd < 0) {
+        return;
+    }
+    memcpy(trapped_instructions, instructions, sizeof(instructions));
+    instructions[0xCC] = gdb_int3;
+    watch_hit_address = UINT32_MAX;
+    serve(emu, 0);
+}
+
+void gdb_detach(Emulator* emu) {
+    if (gdb_fd < 0) {
+        return;
+    }
+    if (trap_armed) {
+        memcpy(instructions, trapped_instructions, sizeof(instructions));
+        trap_armed = 0;
+    }
+    remove_breakpoints(emu);
+    breakpoint_count = 0;
+    watchpoint_count = 0;
+    update_watch_pages(emu);
+    instructions[0xCC] = trapped_instructions[0xCC];
+    close(gdb_fd);
+    gdb_fd = -1;
+}
+
+void gdb_exit(Emulator* emu, int status) {
+    if (gdb_fd < 0) {
+        return;
+    }
+    char buf[8];
+    sprintf(buf, "W%02x", status & 0xff);
+    write_packet(buf);
+    gdb_detach(emu);
+}
@@ -0,0 +1,11 @@
+#ifndef K86_GDBSTUB_H
+#define K86_GDBSTUB_H
+
+#include "emulator.h"
+
+int gdb_open(const char* address);
+void gdb_attach(Emulator* emu);
+void gdb_detach(Emulator* emu);
+void gdb_exit(Emulator* emu, int status);
+
+#endif //K86_GDBSTUB_H
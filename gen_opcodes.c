@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "opcodes.h"
+
+// Runs at build time and writes the tables declared in opcodes.h from
+// opcodes.def. Rows that contradict each other fail the build.
+
+typedef struct {
+    int code;
+    int reg;
+    const char* mnemonic;
+    int form;
+    int flow;
+} Row;
+
+static const Row rows[] = {
+#define OPCODE(code, mnemonic, form, flow, handler) {code, -1, mnemonic, FORM_ ## form, FLOW_ ## flow},
+#define GROUP(code, reg, mnemonic, form, flow) {code, reg, mnemonic, FORM_ ## form, FLOW_ ## flow},
+#define LOCK(code, regs)
+#include "opcodes.def"
+#undef OPCODE
+#undef GROUP
+#undef LOCK
+};
+
+typedef struct {
+    int code;
+    int regs;
+} Lock;
+
+static const Lock locks[] = {
+#define OPCODE(code, mnemonic, form, flow, handler)
+#define GROUP(code, reg, mnemonic, form, flow)
+#define LOCK(code, regs) {code, regs},
+#include "opcodes.def"
+#undef OPCODE
+#undef GROUP
+#undef LOCK
+};
+
+static const uint8_t form_operands[FORM_COUNT][3] = {
+#define FORM_OPERANDS(name, first, second, third) {OPERAND_ ## first, OPERAND_ ## second, OPERAND_ ## third},
+    OPCODE_FORMS(FORM_OPERANDS)
+#undef FORM_OPERANDS
+};
+
+static const char* const operand_names[OPERAND_COUNT] = {
+    "NONE", "EB", "EV", "GB", "GV", "ZB", "ZV", "RD", "CR", "M",
+    "AL", "EAX", "CL", "DX", "ONE", "IB", "IBX", "ID", "JB", "JD"
+};
+
+static const char* const flow_names[] = {
+    "UNKNOWN", "NEXT", "JUMP", "BRANCH", "CALL", "RETURN"
+};
+
+#define ROW_COUNT ((int) (sizeof(rows) / sizeof(rows[0])))
+#define LOCK_COUNT ((int) (sizeof(locks) / sizeof(locks[0])))
+
+static int has_modrm(int form) {
+    for (int i = 0; i < 3; i++) {
+        switch (form_operands[form][i]) {
+            case OPERAND_EB:
+            case OPERAND_EV:
+            case OPERAND_GB:
+            case OPERAND_GV:
+            case OPERAND_RD:
+            case OPERAND_CR:
+            case OPERAND_M:
+                return 1;
+        }
+    }
+    return 0;
+}
+
+static int immediate_size(int form) {
+    int size = 0;
+    for (int i = 0; i < 3; i++) {
+        switch (form_operands[form][i]) {
+            case OPERAND_IB:
+            case OPERAND_IBX:
+            case OPERAND_JB:
+                size += 1;
+                break;
+            case OPERAND_ID:
+            case OPERAND_JD:
+                size += 4;
+                break;
+        }
+    }
+    return size;
+}
+
+// Bytes taken by the ModRM byte and displacement; 0 for a SIB byte, which
+// calc_memory_address does not implement.
+static int modrm_length(int modrm) {
+    int mod = modrm >> 6;
+    int rm = modrm & 0x07;
+    int length = 1;
+
+    if (mod != 3 && rm == 4) {
+        return 0;
+    }
+    if ((mod == 0 && rm == 5) || mod == 2) {
+        length += 4;
+    } else if (mod == 1) {
+        length += 1;
+    }
+    return length;
+}
+
+static void fail(const Row* row, const char* message) {
+    fprintf(stderr, "opcodes.def: opcode %03x: %s\n", row->code, message);
+    exit(1);
+}
+
+static void print_info(FILE* out, const char* mnemonic, int form, int flow, int group) {
+    if (mnemonic == NULL) {
+        fprintf(out, "{NULL, ");
+    } else {
+        fprintf(out, "{\"%s\", ", mnemonic);
+    }
+    fprintf(out, "{OPERAND_%s, OPERAND_%s, OPERAND_%s}, FLOW_%s, %d}",
+            operand_names[form_operands[form][0]], operand_names[form_operands[form][1]],
+            operand_names[form_operands[form][2]], flow_names[flow], group);
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        printf("usage: gen_opcodes output.c\n");
+        return 1;
+    }
+
+    static const Row* opcodes[OPCODE_COUNT];
+    static const Row* groups[OPCODE_COUNT][8];
+    static int group_index[OPCODE_COUNT];
+    int group_count = 1;
+
+    for (int i = 0; i < ROW_COUNT; i++) {
+        const Row* row = &rows[i];
+        if (row->code < 0 || row->code >= OPCODE_COUNT) {
+            fail(row, "out of range");
+        }
+        if (row->reg < 0) {
+            if (opcodes[row->code] != NULL) {
+                fail(row, "listed twice");
+            }
+            opcodes[row->code] = row;
+            if (row->form == FORM_GROUP) {
+                group_index[row->code] = group_count++;
+            }
+        } else {
+            if (opcodes[row->code] == NULL || opcodes[row->code]->form != FORM_GROUP) {
+                fail(row, "group row before its GROUP opcode");
+            }
+            if (groups[row->code][row->reg] != NULL) {
+                fail(row, "group row listed twice");
+            }
+            if (row->form == FORM_GROUP || row->form == FORM_ESCAPE || row->form == FORM_PREFIX) {
+                fail(row, "group row with a nested form");
+            }
+            groups[row->code][row->reg] = row;
+        }
+    }
+
+    FILE* out = fopen(argv[1], "w");
+    if (out == NULL) {
+        printf("Cannot open %s\n", argv[1]);
+        return 1;
+    }
+
+    fprintf(out, "// Generated by gen_opcodes from opcodes.def. Do not edit.\n\n");
+    fprintf(out, "#include \"opcodes.h\"\n\n");
+
+    fprintf(out, "const OpcodeInfo opcode_info[OPCODE_COUNT] = {\n");
+    for (int code = 0; code < OPCODE_COUNT; code++) {
+        const Row* row = opcodes[code];
+        if (row != NULL) {
+            fprintf(out, "    [0x%03x] = ", code);
+            print_info(out, row->mnemonic, row->form, row->flow, group_index[code]);
+            fprintf(out, ",\n");
+        }
+    }
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "const OpcodeInfo group_info[][8] = {\n    {{NULL}},\n");
+    for (int code = 0; code < OPCODE_COUNT; code++) {
+        if (group_index[code] == 0) {
+            continue;
+        }
+        fprintf(out, "    {   // %03x\n", code);
+        for (int reg = 0; reg < 8; reg++) {
+            const Row* row = groups[code][reg];
+            fprintf(out, "        ");
+            if (row == NULL) {
+                fprintf(out, "{NULL}");
+            } else {
+                print_info(out, row->mnemonic, row->form, row->flow, 0);
+            }
+            fprintf(out, ",\n");
+        }
+        fprintf(out, "    },\n");
+    }
+    fprintf(out, "};\n\n");
+
+    static uint8_t lengths[2][OPCODE_COUNT][8];
+    for (int code = 0; code < OPCODE_COUNT; code++) {
+        const Row* row = opcodes[code];
+        if (row == NULL || row->form == FORM_ESCAPE || row->form == FORM_PREFIX) {
+            continue;
+        }
+        for (int reg = 0; reg < 8; reg++) {
+            const Row* entry = row->form == FORM_GROUP ? groups[code][reg] : row;
+            if (entry != NULL) {
+                lengths[0][code][reg] = (1 + immediate_size(entry->form))
+                                        | (has_modrm(entry->form) || row->form == FORM_GROUP) << 7;
+            }
+        }
+    }
+    for (int i = 0; i < LOCK_COUNT; i++) {
+        const Lock* lock = &locks[i];
+        for (int reg = 0; reg < 8; reg++) {
+            if (!(lock->regs & (1 << reg))) {
+                continue;
+            }
+            if (!(lengths[0][lock->code][reg] & 0x80)) {
+                fprintf(stderr, "opcodes.def: opcode %03x/%d: LOCK without a ModRM operand\n", lock->code, reg);
+                exit(1);
+            }
+            lengths[1][lock->code][reg] = lengths[0][lock->code][reg];
+        }
+    }
+
+    fprintf(out, "const uint8_t opcode_lengths[2][OPCODE_COUNT][8] = {\n");
+    for (int prefix = 0; prefix < 2; prefix++) {
+        fprintf(out, "    {   // %s\n", prefix ? "after lock" : "unprefixed");
+        for (int code = 0; code < OPCODE_COUNT; code++) {
+            int used = 0;
+            for (int reg = 0; reg < 8; reg++) {
+                used |= lengths[prefix][code][reg];
+            }
+            if (!used) {
+                continue;
+            }
+            fprintf(out, "        [0x%03x] = {", code);
+            for (int reg = 0; reg < 8; reg++) {
+                fprintf(out, "%s0x%02x", reg == 0 ? "" : ", ", lengths[prefix][code][reg]);
+            }
+            fprintf(out, "},\n");
+        }
+        fprintf(out, "    },\n");
+    }
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "const uint8_t modrm_lengths[256] = {");
+    for (int modrm = 0; modrm < 256; modrm++) {
+        fprintf(out, "%s0x%02x,", modrm % 16 == 0 ? "\n    " : " ", modrm_length(modrm));
+    }
+    fprintf(out, "\n};\n");
+
+    fclose(out);
+    return 0;
+}
@@ -9,6 +9,9 @@
 #include "io.h"
 #include "modrm.h"
 #include "bios.h"
+#include "paging.h"
+#include "spin.h"
+#include "coverage.h"
 
 instruction_func_t* instructions[256];
 
@@ -74,97 +77,495 @@ void mov_r32_rm32(Emulator* emu) {
 
 // arithmetic
 
-void add_rm32_r32(Emulator* emu) {
+// One definition per operation and width. Carry and overflow come from the
+// overflow builtins on the unsigned and signed views of the operands.
+typedef uint8_t alu8_func_t(Emulator*, uint8_t, uint8_t);
+typedef uint32_t alu32_func_t(Emulator*, uint32_t, uint32_t);
+
+#define DEFINE_ALU_OPS(bits) \
+static uint##bits##_t add##bits(Emulator* emu, uint##bits##_t a, uint##bits##_t b) { \
+  uint##bits##_t result; \
+  int##bits##_t signed_result; \
+  int carry = __builtin_add_overflow(a, b, &result); \
+  int overflow = __builtin_add_overflow((int##bits##_t) a, (int##bits##_t) b, &signed_result); \
+  update_eflags(emu, carry, overflow, result == 0, result >> (bits - 1)); \
+  return result; \
+} \
+static uint##bits##_t adc##bits(Emulator* emu, uint##bits##_t a, uint##bits##_t b) { \
+  uint##bits##_t c = is_carry(emu), sum, result; \
+  int##bits##_t signed_sum, signed_result; \
+  int carry = __builtin_add_overflow(a, b, &sum) | __builtin_add_overflow(sum, c, &result); \
+  int overflow = __builtin_add_overflow((int##bits##_t) a, (int##bits##_t) b, &signed_sum) \
+                 ^ __builtin_add_overflow(signed_sum, (int##bits##_t) c, &signed_result); \
+  update_eflags(emu, carry, overflow, result == 0, result >> (bits - 1)); \
+  return result; \
+} \
+static uint##bits##_t sub##bits(Emulator* emu, uint##bits##_t a, uint##bits##_t b) { \
+  uint##bits##_t result; \
+  int##bits##_t signed_result; \
+  int carry = __builtin_sub_overflow(a, b, &result); \
+  int overflow = __builtin_sub_overflow((int##bits##_t) a, (int##bits##_t) b, &signed_result); \
+  update_eflags(emu, carry, overflow, result == 0, result >> (bits - 1)); \
+  return result; \
+} \
+static uint##bits##_t sbb##bits(Emulator* emu, uint##bits##_t a, uint##bits##_t b) { \
+  uint##bits##_t c = is_carry(emu), difference, result; \
+  int##bits##_t signed_difference, signed_result; \
+  int carry = __builtin_sub_overflow(a, b, &difference) | __builtin_sub_overflow(difference, c, &result); \
+  int overflow = __builtin_sub_overflow((int##bits##_t) a, (int##bits##_t) b, &signed_difference) \
+                 ^ __builtin_sub_overflow(signed_difference, (int##bits##_t) c, &signed_result); \
+  update_eflags(emu, carry, overflow, result == 0, result >> (bits - 1)); \
+  return result; \
+} \
+static uint##bits##_t and##bits(Emulator* emu, uint##bits##_t a, uint##bits##_t b) { \
+  uint##bits##_t result = a & b; \
+  update_eflags(emu, 0, 0, result == 0, result >> (bits - 1)); \
+  return result; \
+} \
+static uint##bits##_t or##bits(Emulator* emu, uint##bits##_t a, uint##bits##_t b) { \
+  uint##bits##_t result = a | b; \
+  update_eflags(emu, 0, 0, result == 0, result >> (bits - 1)); \
+  return result; \
+} \
+static uint##bits##_t xor##bits(Emulator* emu, uint##bits##_t a, uint##bits##_t b) { \
+  uint##bits##_t result = a ^ b; \
+  update_eflags(emu, 0, 0, result == 0, result >> (bits - 1)); \
+  return result; \
+} \
+static uint##bits##_t inc##bits(Emulator* emu, uint##bits##_t a, uint##bits##_t b) { \
+  int##bits##_t signed_result; \
+  int overflow = __builtin_add_overflow((int##bits##_t) a, 1, &signed_result); \
+  uint##bits##_t result = signed_result; \
+  update_eflags(emu, is_carry(emu), overflow, result == 0, result >> (bits - 1)); \
+  return result; \
+} \
+static uint##bits##_t dec##bits(Emulator* emu, uint##bits##_t a, uint##bits##_t b) { \
+  int##bits##_t signed_result; \
+  int overflow = __builtin_sub_overflow((int##bits##_t) a, 1, &signed_result); \
+  uint##bits##_t result = signed_result; \
+  update_eflags(emu, is_carry(emu), overflow, result == 0, result >> (bits - 1)); \
+  return result; \
+} \
+static uint##bits##_t not##bits(Emulator* emu, uint##bits##_t a, uint##bits##_t b) { \
+  return ~a; \
+} \
+static uint##bits##_t neg##bits(Emulator* emu, uint##bits##_t a, uint##bits##_t b) { \
+  return sub##bits(emu, 0, a); \
+} \
+static alu##bits##_func_t* const alu##bits[8] = { \
+  add##bits, or##bits, adc##bits, sbb##bits, and##bits, sub##bits, xor##bits, sub##bits \
+}; \
+static alu##bits##_func_t* const unary##bits[4] = { \
+  inc##bits, dec##bits, not##bits, neg##bits \
+};
+
+DEFINE_ALU_OPS(8)
+DEFINE_ALU_OPS(32)
+
+// The six encodings of each of the 00-3F operations.
+#define DEFINE_ALU_RM_R(name, op, writeback) \
+static void name ## _rm8_r8(Emulator* emu) { \
+  emu->eip += 1; \
+  ModRM modrm; \
+  parse_modrm(emu, &modrm); \
+  uint8_t result = op ## 8(emu, get_rm8(emu, &modrm), get_r8(emu, &modrm)); \
+  if (writeback) set_rm8(emu, &modrm, result); \
+} \
+static void name ## _rm32_r32(Emulator* emu) { \
+  emu->eip += 1; \
+  ModRM modrm; \
+  parse_modrm(emu, &modrm); \
+  uint32_t result = op ## 32(emu, get_rm32(emu, &modrm), get_r32(emu, &modrm)); \
+  if (writeback) set_rm32(emu, &modrm, result); \
+}
+
+#define DEFINE_ALU_R_RM(name, op, writeback) \
+static void name ## _r8_rm8(Emulator* emu) { \
+  emu->eip += 1; \
+  ModRM modrm; \
+  parse_modrm(emu, &modrm); \
+  uint8_t result = op ## 8(emu, get_r8(emu, &modrm), get_rm8(emu, &modrm)); \
+  if (writeback) set_r8(emu, &modrm, result); \
+} \
+static void name ## _r32_rm32(Emulator* emu) { \
+  emu->eip += 1; \
+  ModRM modrm; \
+  parse_modrm(emu, &modrm); \
+  uint32_t result = op ## 32(emu, get_r32(emu, &modrm), get_rm32(emu, &modrm)); \
+  if (writeback) set_r32(emu, &modrm, result); \
+}
+
+#define DEFINE_ALU_ACC(name, op, writeback) \
+static void name ## _al_imm8(Emulator* emu) { \
+  uint8_t result = op ## 8(emu, get_register8(emu, AL), get_code8(emu, 1)); \
+  if (writeback) set_register8(emu, AL, result); \
+  emu->eip += 2; \
+} \
+static void name ## _eax_imm32(Emulator* emu) { \
+  uint32_t result = op ## 32(emu, get_register32(emu, EAX), get_code32(emu, 1)); \
+  if (writeback) set_register32(emu, EAX, result); \
+  emu->eip += 5; \
+}
+
+#define DEFINE_ALU(name, op, writeback) \
+DEFINE_ALU_RM_R(name, op, writeback) \
+DEFINE_ALU_R_RM(name, op, writeback) \
+DEFINE_ALU_ACC(name, op, writeback)
+
+DEFINE_ALU(add, add, 1)
+DEFINE_ALU(or, or, 1)
+DEFINE_ALU(adc, adc, 1)
+DEFINE_ALU(sbb, sbb, 1)
+DEFINE_ALU(and, and, 1)
+DEFINE_ALU(sub, sub, 1)
+DEFINE_ALU(xor, xor, 1)
+DEFINE_ALU(cmp, sub, 0)
+DEFINE_ALU_RM_R(test, and, 0)
+DEFINE_ALU_ACC(test, and, 0)
+
+// 80, 81 and 83: the operation is in the reg field, 7 (cmp) does not write back.
+
+void code_80(Emulator* emu) {
     emu->eip += 1;
     ModRM modrm;
     parse_modrm(emu, &modrm);
 
-    uint32_t r32 = get_r32(emu, &modrm);
-    uint32_t rm32 = get_rm32(emu, &modrm);
-    set_rm32(emu, &modrm, rm32 + r32);
+    uint8_t imm8 = get_code8(emu, 0);
+    emu->eip += 1;
+    uint8_t result = alu8[modrm.opcode](emu, get_rm8(emu, &modrm), imm8);
+    if (modrm.opcode != 7) {
+        set_rm8(emu, &modrm, result);
+    }
 }
 
-static void add_rm32_imm8(Emulator* emu, ModRM* modrm)
-{
-    uint32_t rm32 = get_rm32(emu, modrm);
-    uint32_t imm8 = (int32_t) get_signed_code8(emu, 0);
+void code_81(Emulator* emu) {
     emu->eip += 1;
-    set_rm32(emu, modrm, rm32 + imm8);
+    ModRM modrm;
+    parse_modrm(emu, &modrm);
+
+    uint32_t imm32 = get_code32(emu, 0);
+    emu->eip += 4;
+    uint32_t result = alu32[modrm.opcode](emu, get_rm32(emu, &modrm), imm32);
+    if (modrm.opcode != 7) {
+        set_rm32(emu, &modrm, result);
+    }
 }
 
-void sub_rm32_imm8(Emulator* emu, ModRM* modrm) {
-    uint32_t rm32 = get_rm32(emu, modrm);
+void code_83(Emulator* emu) {
+    emu->eip += 1;
+    ModRM modrm;
+    parse_modrm(emu, &modrm);
+
     uint32_t imm8 = (int32_t) get_signed_code8(emu, 0);
-    uint64_t result = (uint64_t) rm32 - (uint64_t) imm8;
     emu->eip += 1;
-    set_rm32(emu, modrm, rm32 - imm8);
-    update_eflags_sub(emu, rm32, imm8, result);
+    uint32_t result = alu32[modrm.opcode](emu, get_rm32(emu, &modrm), imm8);
+    if (modrm.opcode != 7) {
+        set_rm32(emu, &modrm, result);
+    }
 }
 
-void inc_r32(Emulator* emu, ModRM* modrm) {
+void inc_r32(Emulator* emu) {
     uint8_t reg = get_code8(emu, 0) - 0x40;
-    set_register32(emu, reg, get_register32(emu, reg) + 1);
+    set_register32(emu, reg, inc32(emu, get_register32(emu, reg), 0));
     emu->eip += 1;
 }
 
-void inc_rm32(Emulator* emu, ModRM* modrm) {
-    uint32_t value = get_rm32(emu, modrm);
-    set_rm32(emu, modrm, value + 1);
+void dec_r32(Emulator* emu) {
+    uint8_t reg = get_code8(emu, 0) - 0x48;
+    set_register32(emu, reg, dec32(emu, get_register32(emu, reg), 0));
+    emu->eip += 1;
 }
 
-// cmp
+void imul_r32_rm32_imm32(Emulator* emu) {
+    emu->eip += 1;
+    ModRM modrm;
+    parse_modrm(emu, &modrm);
+
+    int32_t imm32 = get_signed_code32(emu, 0);
+    emu->eip += 4;
+    int32_t result;
+    int overflow = __builtin_mul_overflow((int32_t) get_rm32(emu, &modrm), imm32, &result);
+    set_carry(emu, overflow);
+    set_overflow(emu, overflow);
+    set_r32(emu, &modrm, result);
+}
 
-void cmp_r32_rm32(Emulator* emu) {
+void imul_r32_rm32_imm8(Emulator* emu) {
     emu->eip += 1;
     ModRM modrm;
     parse_modrm(emu, &modrm);
 
-    uint32_t r32 = get_r32(emu, &modrm);
-    uint32_t rm32 = get_rm32(emu, &modrm);
-    uint64_t result = (uint64_t) r32 - (uint64_t) rm32;
-    update_eflags_sub(emu, r32, rm32, result);
+    int32_t imm8 = get_signed_code8(emu, 0);
+    emu->eip += 1;
+    int32_t result;
+    int overflow = __builtin_mul_overflow((int32_t) get_rm32(emu, &modrm), imm8, &result);
+    set_carry(emu, overflow);
+    set_overflow(emu, overflow);
+    set_r32(emu, &modrm, result);
 }
 
-void cmp_rm32_imm8(Emulator* emu, ModRM* modrm) {
-    uint32_t rm32 = get_rm32(emu, modrm);
-    uint32_t imm8 = (int32_t) get_signed_code8(emu, 0);
-    uint64_t result = (uint64_t) rm32 - (uint64_t) imm8;
-    update_eflags_sub(emu, rm32, imm8, result);
+static void imul_r32_rm32(Emulator* emu) {
+    ModRM modrm;
+    parse_modrm(emu, &modrm);
+
+    int32_t result;
+    int overflow = __builtin_mul_overflow((int32_t) get_r32(emu, &modrm), (int32_t) get_rm32(emu, &modrm), &result);
+    set_carry(emu, overflow);
+    set_overflow(emu, overflow);
+    set_r32(emu, &modrm, result);
+}
+
+// shift and rotate: C0, C1, D0-D3, operation in the reg field
+
+#define DEFINE_SHIFT(bits) \
+static uint##bits##_t shift##bits(Emulator* emu, int op, uint##bits##_t value, uint8_t count) { \
+  const int msb = bits - 1; \
+  uint##bits##_t result = value; \
+  int carry = is_carry(emu); \
+  int overflow; \
+  count &= 0x1f; \
+  if (count == 0) { \
+    return value; \
+  } \
+  switch (op) { \
+    case 0: \
+      result = (uint32_t) value << (count % bits) | value >> ((bits - count % bits) % bits); \
+      carry = result & 1; \
+      overflow = (result >> msb) ^ carry; \
+      break; \
+    case 1: \
+      result = value >> (count % bits) | (uint32_t) value << ((bits - count % bits) % bits); \
+      carry = result >> msb; \
+      overflow = (result >> msb) ^ ((result >> (msb - 1)) & 1); \
+      break; \
+    case 2: \
+      for (int i = 0; i < count % (bits + 1); i++) { \
+        int out = result >> msb; \
+        result = (uint32_t) result << 1 | carry; \
+        carry = out; \
+      } \
+      overflow = (result >> msb) ^ carry; \
+      break; \
+    case 3: \
+      overflow = (value >> msb) ^ carry; \
+      for (int i = 0; i < count % (bits + 1); i++) { \
+        int out = result & 1; \
+        result = result >> 1 | (uint32_t) carry << msb; \
+        carry = out; \
+      } \
+      break; \
+    case 4: \
+    case 6: \
+      result = (uint32_t) value << count; \
+      carry = count <= bits ? (value >> (bits - count)) & 1 : 0; \
+      overflow = (result >> msb) ^ carry; \
+      break; \
+    case 5: \
+      result = value >> count; \
+      carry = count <= bits ? (value >> (count - 1)) & 1 : 0; \
+      overflow = value >> msb; \
+      break; \
+    default: \
+      result = (int##bits##_t) value >> count; \
+      carry = ((int##bits##_t) value >> (count - 1)) & 1; \
+      overflow = 0; \
+      break; \
+  } \
+  if (op < 4) { \
+    set_carry(emu, carry); \
+    set_overflow(emu, overflow); \
+  } else { \
+    update_eflags(emu, carry, overflow, result == 0, result >> msb); \
+  } \
+  return result; \
+}
+
+DEFINE_SHIFT(8)
+DEFINE_SHIFT(32)
+
+static void shift_rm8(Emulator* emu, ModRM* modrm, uint8_t count) {
+    set_rm8(emu, modrm, shift8(emu, modrm->opcode, get_rm8(emu, modrm), count));
+}
+
+static void shift_rm32(Emulator* emu, ModRM* modrm, uint8_t count) {
+    set_rm32(emu, modrm, shift32(emu, modrm->opcode, get_rm32(emu, modrm), count));
+}
+
+void code_c0(Emulator* emu) {
+    emu->eip += 1;
+    ModRM modrm;
+    parse_modrm(emu, &modrm);
+
+    uint8_t count = get_code8(emu, 0);
+    emu->eip += 1;
+    shift_rm8(emu, &modrm, count);
 }
 
-void cmp_al_imm8(Emulator* emu) {
-    uint8_t value = get_code8(emu, 1);
-    uint8_t al = get_register8(emu, AL);
-    uint64_t result = (uint64_t) al - (uint64_t) value;
-    update_eflags_sub(emu, al, value, result);
-    emu->eip += 2;
+void code_c1(Emulator* emu) {
+    emu->eip += 1;
+    ModRM modrm;
+    parse_modrm(emu, &modrm);
+
+    uint8_t count = get_code8(emu, 0);
+    emu->eip += 1;
+    shift_rm32(emu, &modrm, count);
 }
 
-void cmp_eax_imm32(Emulator* emu) {
-    uint32_t value = get_code32(emu, 1);
-    uint32_t eax = get_register32(emu, EAX);
-    uint64_t result = (uint64_t) eax - (uint64_t) value;
-    update_eflags_sub(emu, eax, value, result);
-    emu->eip += 5;
+void code_d0(Emulator* emu) {
+    emu->eip += 1;
+    ModRM modrm;
+    parse_modrm(emu, &modrm);
+    shift_rm8(emu, &modrm, 1);
 }
 
-void code_83(Emulator* emu) {
+void code_d1(Emulator* emu) {
     emu->eip += 1;
     ModRM modrm;
     parse_modrm(emu, &modrm);
+    shift_rm32(emu, &modrm, 1);
+}
+
+void code_d2(Emulator* emu) {
+    emu->eip += 1;
+    ModRM modrm;
+    parse_modrm(emu, &modrm);
+    shift_rm8(emu, &modrm, get_register8(emu, CL));
+}
+
+void code_d3(Emulator* emu) {
+    emu->eip += 1;
+    ModRM modrm;
+    parse_modrm(emu, &modrm);
+    shift_rm32(emu, &modrm, get_register8(emu, CL));
+}
 
+// F6 and F7: test, not, neg, mul, imul, div, idiv
+
+static void divide_error(Emulator* emu) {
+    printf("Divide error: eip=%08x\n", emu->eip);
+    coverage_fault();
+    exit(1);
+}
+
+void code_f6(Emulator* emu) {
+    emu->eip += 1;
+    ModRM modrm;
+    parse_modrm(emu, &modrm);
+
+    uint8_t rm8 = get_rm8(emu, &modrm);
+    uint16_t ax = get_register32(emu, EAX) & 0xffff;
     switch (modrm.opcode) {
         case 0:
-            add_rm32_imm8(emu, &modrm);
+        case 1:
+            and8(emu, rm8, get_code8(emu, 0));
+            emu->eip += 1;
             break;
-        case 5:
-            sub_rm32_imm8(emu, &modrm);
+        case 2:
+        case 3:
+            set_rm8(emu, &modrm, unary8[modrm.opcode](emu, rm8, 0));
             break;
-        case 7:
-            cmp_rm32_imm8(emu, &modrm);
+        case 4: {
+            uint16_t result = (uint16_t) get_register8(emu, AL) * rm8;
+            set_register32(emu, EAX, (get_register32(emu, EAX) & 0xffff0000) | result);
+            set_carry(emu, result >> 8);
+            set_overflow(emu, result >> 8);
+            break;
+        }
+        case 5: {
+            int16_t result = (int16_t) (int8_t) get_register8(emu, AL) * (int8_t) rm8;
+            set_register32(emu, EAX, (get_register32(emu, EAX) & 0xffff0000) | (uint16_t) result);
+            set_carry(emu, result != (int8_t) result);
+            set_overflow(emu, result != (int8_t) result);
+            break;
+        }
+        case 6:
+            if (rm8 == 0 || ax / rm8 > 0xff) {
+                divide_error(emu);
+            }
+            set_register8(emu, AL, ax / rm8);
+            set_register8(emu, AH, ax % rm8);
+            break;
+        default: {
+            int16_t dividend = (int16_t) ax;
+            if (rm8 == 0 || dividend / (int8_t) rm8 != (int8_t) (dividend / (int8_t) rm8)) {
+                divide_error(emu);
+            }
+            set_register8(emu, AL, dividend / (int8_t) rm8);
+            set_register8(emu, AH, dividend % (int8_t) rm8);
+            break;
+        }
+    }
+}
+
+void code_f7(Emulator* emu) {
+    emu->eip += 1;
+    ModRM modrm;
+    parse_modrm(emu, &modrm);
+
+    uint32_t rm32 = get_rm32(emu, &modrm);
+    uint32_t eax = get_register32(emu, EAX);
+    uint64_t edx_eax = (uint64_t) get_register32(emu, EDX) << 32 | eax;
+    switch (modrm.opcode) {
+        case 0:
+        case 1:
+            and32(emu, rm32, get_code32(emu, 0));
+            emu->eip += 4;
+            break;
+        case 2:
+        case 3:
+            set_rm32(emu, &modrm, unary32[modrm.opcode](emu, rm32, 0));
+            break;
+        case 4: {
+            uint64_t result = (uint64_t) eax * rm32;
+            set_register32(emu, EAX, result);
+            set_register32(emu, EDX, result >> 32);
+            set_carry(emu, (result >> 32) != 0);
+            set_overflow(emu, (result >> 32) != 0);
+            break;
+        }
+        case 5: {
+            int64_t result = (int64_t) (int32_t) eax * (int32_t) rm32;
+            set_register32(emu, EAX, result);
+            set_register32(emu, EDX, (uint64_t) result >> 32);
+            set_carry(emu, result != (int32_t) result);
+            set_overflow(emu, result != (int32_t) result);
+            break;
+        }
+        case 6:
+            if (rm32 == 0 || edx_eax / rm32 > 0xffffffff) {
+                divide_error(emu);
+            }
+            set_register32(emu, EAX, edx_eax / rm32);
+            set_register32(emu, EDX, edx_eax % rm32);
+            break;
+        default: {
+            int64_t dividend = (int64_t) edx_eax;
+            if (rm32 == 0 || (dividend == INT64_MIN && (int32_t) rm32 == -1)
+                || dividend / (int32_t) rm32 != (int32_t) (dividend / (int32_t) rm32)) {
+                divide_error(emu);
+            }
+            set_register32(emu, EAX, dividend / (int32_t) rm32);
+            set_register32(emu, EDX, dividend % (int32_t) rm32);
+            break;
+        }
+    }
+}
+
+// FE and FF: inc and dec in the reg field
+
+void code_fe(Emulator* emu) {
+    emu->eip += 1;
+    ModRM modrm;
+    parse_modrm(emu, &modrm);
+
+    switch (modrm.opcode) {
+        case 0:
+        case 1:
+            set_rm8(emu, &modrm, unary8[modrm.opcode](emu, get_rm8(emu, &modrm), 0));
             break;
         default:
-            printf("Not implemented yet: code=83/%d", modrm.opcode);
+            printf("Not implemented yet: code=fe/%d", modrm.opcode);
+            coverage_fault();
             exit(1);
     }
 }
@@ -176,19 +577,308 @@ void code_ff(Emulator* emu) {
 
     switch (modrm.opcode) {
         case 0:
-            inc_rm32(emu, &modrm);
+        case 1:
+            set_rm32(emu, &modrm, unary32[modrm.opcode](emu, get_rm32(emu, &modrm), 0));
             break;
         default:
             printf("Not implemented yet: code=ff/%d", modrm.opcode);
+            coverage_fault();
             exit(1);
     }
 }
 
+// atomic
+
+// A locked access that straddles two pages could not be done as one host
+// atomic, so it is refused like any other unimplemented form.
+static uint8_t* atomic_pointer(Emulator* emu, ModRM* modrm, int size) {
+    uint32_t address = calc_memory_address(emu, modrm);
+    if (!within_page(address, size)) {
+        printf("Not implemented yet: locked access across pages: address=%08x, eip=%08x\n", address, emu->eip);
+        coverage_fault();
+        exit(1);
+    }
+    if (emu->watch_pages != NULL && emu->watch_pages[address >> PAGE_SHIFT]) {
+        gdb_watch_store(emu, address);
+    }
+    return translate(emu, address, ACCESS_WRITE);
+}
+
+// Runs an ALU operation on memory as a compare-and-swap loop; the flags are
+// those of the attempt that stored. Returns the old value.
+static uint8_t atomic_alu8(Emulator* emu, ModRM* modrm, alu8_func_t* op, uint8_t value) {
+    uint8_t* p = atomic_pointer(emu, modrm, 1);
+    uint32_t eflags = emu->eflags;
+    uint8_t old = __atomic_load_n(p, __ATOMIC_RELAXED);
+    uint8_t result;
+    do {
+        emu->eflags = eflags;
+        result = op(emu, old, value);
+    } while (!__atomic_compare_exchange_n(p, &old, result, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+    return old;
+}
+
+static uint32_t atomic_alu32(Emulator* emu, ModRM* modrm, alu32_func_t* op, uint32_t value) {
+    uint32_t* p = (uint32_t*) atomic_pointer(emu, modrm, 4);
+    uint32_t eflags = emu->eflags;
+    uint32_t old = __atomic_load_n(p, __ATOMIC_RELAXED);
+    uint32_t result;
+    do {
+        emu->eflags = eflags;
+        result = op(emu, old, value);
+    } while (!__atomic_compare_exchange_n(p, &old, result, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+    return old;
+}
+
+void xchg_rm8_r8(Emulator* emu) {
+    emu->eip += 1;
+    ModRM modrm;
+    parse_modrm(emu, &modrm);
+
+    uint8_t r8 = get_r8(emu, &modrm);
+    if (modrm.mod == 3) {
+        set_r8(emu, &modrm, get_rm8(emu, &modrm));
+        set_rm8(emu, &modrm, r8);
+    } else {
+        set_r8(emu, &modrm, __atomic_exchange_n(atomic_pointer(emu, &modrm, 1), r8, __ATOMIC_SEQ_CST));
+    }
+}
+
+void xchg_rm32_r32(Emulator* emu) {
+    emu->eip += 1;
+    ModRM modrm;
+    parse_modrm(emu, &modrm);
+
+    uint32_t r32 = get_r32(emu, &modrm);
+    if (modrm.mod == 3) {
+        set_r32(emu, &modrm, get_rm32(emu, &modrm));
+        set_rm32(emu, &modrm, r32);
+    } else {
+        uint32_t old = __atomic_exchange_n((uint32_t*) atomic_pointer(emu, &modrm, 4), r32, __ATOMIC_SEQ_CST);
+        set_r32(emu, &modrm, old);
+    }
+}
+
+static void cmpxchg_rm32_r32(Emulator* emu) {
+    ModRM modrm;
+    parse_modrm(emu, &modrm);
+
+    uint32_t eax = get_register32(emu, EAX);
+    uint32_t r32 = get_r32(emu, &modrm);
+    uint32_t old;
+    if (modrm.mod == 3) {
+        old = get_rm32(emu, &modrm);
+        if (old == eax) {
+            set_rm32(emu, &modrm, r32);
+        }
+    } else {
+        old = eax;
+        __atomic_compare_exchange_n((uint32_t*) atomic_pointer(emu, &modrm, 4), &old, r32, 0,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    }
+    sub32(emu, eax, old);
+    if (old != eax) {
+        set_register32(emu, EAX, old);
+    }
+}
+
+static void xadd_rm8_r8(Emulator* emu) {
+    ModRM modrm;
+    parse_modrm(emu, &modrm);
+
+    uint8_t r8 = get_r8(emu, &modrm);
+    if (modrm.mod == 3) {
+        uint8_t rm8 = get_rm8(emu, &modrm);
+        set_r8(emu, &modrm, rm8);
+        set_rm8(emu, &modrm, add8(emu, rm8, r8));
+    } else {
+        set_r8(emu, &modrm, atomic_alu8(emu, &modrm, add8, r8));
+    }
+}
+
+static void xadd_rm32_r32(Emulator* emu) {
+    ModRM modrm;
+    parse_modrm(emu, &modrm);
+
+    uint32_t r32 = get_r32(emu, &modrm);
+    if (modrm.mod == 3) {
+        uint32_t rm32 = get_rm32(emu, &modrm);
+        set_r32(emu, &modrm, rm32);
+        set_rm32(emu, &modrm, add32(emu, rm32, r32));
+    } else {
+        set_r32(emu, &modrm, atomic_alu32(emu, &modrm, add32, r32));
+    }
+}
+
+static void lock_not_implemented(uint8_t code, ModRM* modrm) {
+    printf("Not implemented yet: code=lock %02x/%d", code, modrm->opcode);
+    coverage_fault();
+    exit(1);
+}
+
+// xchg, cmpxchg and xadd with a memory operand are atomic with or without the
+// prefix. Every other lockable instruction is an ALU operation on memory.
+void lock_prefix(Emulator* emu) {
+    uint8_t code = get_code8(emu, 1);
+    emu->eip += 1;
+
+    if (code == 0x0F) {
+        uint8_t code_0f = get_code8(emu, 1);
+        if (code_0f != 0xB1 && code_0f != 0xC0 && code_0f != 0xC1) {
+            printf("Not implemented yet: code=lock 0f %02x", code_0f);
+            coverage_fault();
+            exit(1);
+        }
+    }
+    if (code == 0x0F || code == 0x86 || code == 0x87) {
+        instructions[code](emu);
+        return;
+    }
+
+    emu->eip += 1;
+    ModRM modrm;
+    parse_modrm(emu, &modrm);
+
+    if (code < 0x40 && (code & 0x07) <= 1 && (code >> 3) != 7) {
+        if (code & 1) {
+            atomic_alu32(emu, &modrm, alu32[code >> 3], get_r32(emu, &modrm));
+        } else {
+            atomic_alu8(emu, &modrm, alu8[code >> 3], get_r8(emu, &modrm));
+        }
+        return;
+    }
+
+    switch (code) {
+        case 0x80:
+        case 0x81:
+        case 0x83: {
+            if (modrm.opcode == 7) {
+                lock_not_implemented(code, &modrm);
+            }
+            uint32_t imm;
+            if (code == 0x81) {
+                imm = get_code32(emu, 0);
+                emu->eip += 4;
+            } else {
+                imm = code == 0x83 ? (uint32_t) get_signed_code8(emu, 0) : get_code8(emu, 0);
+                emu->eip += 1;
+            }
+            if (code == 0x80) {
+                atomic_alu8(emu, &modrm, alu8[modrm.opcode], imm);
+            } else {
+                atomic_alu32(emu, &modrm, alu32[modrm.opcode], imm);
+            }
+            break;
+        }
+        case 0xF6:
+        case 0xF7:
+        case 0xFE:
+        case 0xFF: {
+            int valid = code >= 0xFE ? modrm.opcode <= 1 : modrm.opcode == 2 || modrm.opcode == 3;
+            if (!valid) {
+                lock_not_implemented(code, &modrm);
+            }
+            if (code & 1) {
+                atomic_alu32(emu, &modrm, unary32[modrm.opcode], 0);
+            } else {
+                atomic_alu8(emu, &modrm, unary8[modrm.opcode], 0);
+            }
+            break;
+        }
+        default:
+            lock_not_implemented(code, &modrm);
+    }
+}
+
+// system
+
+static void mov_r32_cr(Emulator* emu) {
+    ModRM modrm;
+    parse_modrm(emu, &modrm);
+
+    switch (modrm.reg_index) {
+        case 0:
+            set_register32(emu, modrm.rm, emu->cr0);
+            break;
+        case 2:
+            set_register32(emu, modrm.rm, emu->cr2);
+            break;
+        case 3:
+            set_register32(emu, modrm.rm, emu->cr3);
+            break;
+        default:
+            printf("Not implemented yet: mov r32, cr%d", modrm.reg_index);
+            coverage_fault();
+            exit(1);
+    }
+}
+
+static void mov_cr_r32(Emulator* emu) {
+    ModRM modrm;
+    parse_modrm(emu, &modrm);
+
+    uint32_t value = get_register32(emu, modrm.rm);
+    switch (modrm.reg_index) {
+        case 0:
+            emu->cr0 = value;
+            tlb_flush(emu);
+            break;
+        case 2:
+            emu->cr2 = value;
+            break;
+        case 3:
+            emu->cr3 = value;
+            tlb_flush(emu);
+            break;
+        default:
+            printf("Not implemented yet: mov cr%d, r32", modrm.reg_index);
+            coverage_fault();
+            exit(1);
+    }
+}
+
+static void code_0f_01(Emulator* emu) {
+    ModRM modrm;
+    parse_modrm(emu, &modrm);
+
+    switch (modrm.opcode) {
+        case 7:
+            tlb_flush_page(emu, calc_memory_address(emu, &modrm));
+            break;
+        default:
+            printf("Not implemented yet: code=0f 01/%d", modrm.opcode);
+            coverage_fault();
+            exit(1);
+    }
+}
+
+static instruction_func_t* instructions_0f[256];
+
+void code_0f(Emulator* emu) {
+    uint8_t code = get_code8(emu, 1);
+    emu->eip += 2;
+
+    if (instructions_0f[code] == NULL) {
+        printf("Not implemented yet: code=0f %02x", code);
+        coverage_fault();
+        exit(1);
+    }
+    instructions_0f[code](emu);
+}
+
 // jump
 
-void short_jump(Emulator* emu) {
-    int8_t diff = get_signed_code8(emu, 1);
+// Backward short jumps close loops, so they are where spinning is detected.
+static void jump_rel8(Emulator* emu, int diff) {
+    uint32_t branch = emu->eip;
     emu->eip += diff + 2;
+    if (diff < 0) {
+        spin_check(emu, branch);
+    }
+}
+
+void short_jump(Emulator* emu) {
+    jump_rel8(emu, get_signed_code8(emu, 1));
 }
 
 void near_jump(Emulator *emu) {
@@ -205,11 +895,11 @@ void call_rel32(Emulator* emu) {
 #define DEFINE_JX(flag, is_flag) \
 static void j ## flag(Emulator* emu) { \
   int diff = is_flag(emu) ? get_signed_code8(emu, 1) : 0; \
-  emu->eip += diff + 2; \
+  jump_rel8(emu, diff); \
 } \
 static void jn ## flag(Emulator* emu) { \
   int diff = !is_flag(emu) ? get_signed_code8(emu, 1) : 0; \
-  emu->eip += diff + 2; \
+  jump_rel8(emu, diff); \
 } \
 
 DEFINE_JX(c, is_carry)
@@ -219,12 +909,12 @@ DEFINE_JX(o, is_overflow)
 
 void jl(Emulator* emu) {
     int diff = (is_sign(emu) != is_overflow(emu)) ? get_signed_code8(emu, 1) : 0;
-    emu->eip += (diff + 2);
+    jump_rel8(emu, diff);
 }
 
 void jle(Emulator* emu) {
     int diff = (is_zero(emu) || (is_sign(emu) != is_overflow(emu))) ? get_signed_code8(emu, 1) : 0;
-    emu->eip += (diff + 2);
+    jump_rel8(emu, diff);
 }
 
 void ret(Emulator* emu) {
@@ -268,7 +958,7 @@ void leave(Emulator* emu) {
 
 void in_al_dx(Emulator* emu) {
     uint16_t address = get_register32(emu, EDX) & 0xffff;
-    uint8_t value = io_in8(address);
+    uint8_t value = io_in8(emu, address);
     set_register8(emu, AL, value);
     emu->eip += 1;
 }
@@ -276,7 +966,7 @@ void in_al_dx(Emulator* emu) {
 void out_dx_al(Emulator* emu) {
     uint16_t address = get_register32(emu, EDX) & 0xffff;
     uint8_t value = get_register8(emu, AL);
-    io_out8(address, value);
+    io_out8(emu, address, value);
     emu->eip += 1;
 }
 
@@ -297,62 +987,18 @@ void swi(Emulator* emu) {
 
 void init_instructions(void) {
     memset(instructions, 0, sizeof(instructions));
+    memset(instructions_0f, 0, sizeof(instructions_0f));
 
-    instructions[0x01] = add_rm32_r32;
-
-    instructions[0x3B] = cmp_r32_rm32;
-    instructions[0x3C] = cmp_al_imm8;
-    instructions[0x3D] = cmp_eax_imm32;
-
-    for (int i = 0; i < 8; i++) {
-        instructions[0x40 + i] = inc_r32;
-    }
-
-    for (int i = 0; i < 8; i++) {
-        instructions[0x50 + i] = push_r32;
-    }
-
-    for (int i = 0; i < 8; i++) {
-        instructions[0x58 + i] = pop_r32;
+#define OPCODE(code, mnemonic, form, flow, handler) \
+    if ((code) < 0x100) { \
+        instructions[(code) & 0xff] = handler; \
+    } else { \
+        instructions_0f[(code) & 0xff] = handler; \
     }
-
-    instructions[0x68] = push_imm32;
-    instructions[0x6A] = push_imm8;
-
-    instructions[0x70] = jo;
-    instructions[0x71] = jno;
-    instructions[0x72] = jc;
-    instructions[0x73] = jnc;
-    instructions[0x74] = jz;
-    instructions[0x75] = jnz;
-    instructions[0x78] = js;
-    instructions[0x79] = jns;
-    instructions[0x7C] = jl;
-    instructions[0x7E] = jle;
-
-    instructions[0x83] = code_83;
-    instructions[0x88] = mov_rm8_r8;
-    instructions[0x89] = mov_rm32_r32;
-    instructions[0x8A] = mov_r8_rm8;
-    instructions[0x8B] = mov_r32_rm32;
-
-    for (int i = 0; i < 8; i++) {
-        instructions[0xB0 + i] = mov_r8_imm8;
-    }
-    for (int i = 0; i < 8; i++) {
-        instructions[0xB8 + i] = mov_r32_imm32;
-    }
-
-    instructions[0xC3] = ret;
-    instructions[0xCD] = swi;
-    instructions[0xC7] = mov_rm32_imm32;
-    instructions[0xC9] = leave;
-
-    instructions[0xE8] = call_rel32;
-    instructions[0xE9] = near_jump;
-    instructions[0xEB] = short_jump;
-    instructions[0xEC] = in_al_dx;
-    instructions[0xEE] = out_dx_al;
-
-    instructions[0xFF] = code_ff;
-}
\ No newline at end of file
+#define GROUP(code, reg, mnemonic, form, flow)
+#define LOCK(code, regs)
+#include "opcodes.def"
+#undef OPCODE
+#undef GROUP
+#undef LOCK
+}
@@ -6,21 +6,58 @@
 #define K86_IO_H
 
 #include <stdint.h>
+#include "emulator.h"
+#include "smp.h"
+#include "replay.h"
+#include "serial.h"
 
-static uint8_t io_in8(uint16_t address) {
+static uint8_t device_in8(Emulator* emu, uint16_t address) {
     switch (address) {
-        case 0x03f8:
-            return getchar();
+        case SERIAL_DATA_PORT:
+            return serial_read();
+        case SERIAL_LINE_STATUS_PORT:
+            return serial_line_status();
+        case APIC_ID_PORT:
+            return emu->cpu_id;
         default:
             return 0;
     }
 }
 
-static void io_out8(uint16_t address, uint8_t value) {
+// Port reads are the only non-deterministic input, so they are what a replay
+// log holds.
+static uint8_t io_in8(Emulator* emu, uint16_t address) {
+    if (replay_mode == REPLAY_PLAY) {
+        return replay_play_in8(emu, address);
+    }
+
+    uint8_t value = device_in8(emu, address);
+    if (replay_mode == REPLAY_RECORD) {
+        replay_record_in8(emu, address, value);
+    }
+    return value;
+}
+
+// Blocks until the device behind a polled port may have changed; returns 0
+// for ports whose value never changes on its own.
+static int io_wait_event(uint16_t address) {
+    switch (address) {
+        case SERIAL_LINE_STATUS_PORT:
+            serial_wait();
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static void io_out8(Emulator* emu, uint16_t address, uint8_t value) {
     switch (address) {
-        case 0x03f8:
+        case SERIAL_DATA_PORT:
             putchar(value);
             break;
+        case APIC_ICR_PORT:
+            smp_startup_ipi(emu, value);
+            break;
     }
 }
 
@@ -0,0 +1,446 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aot.h"
+#include "opcodes.h"
+
+#define IMAGE_BASE 0x7c00
+#define IMAGE_SIZE 0x200
+// Room for the decoder to read past the last instruction of the image.
+#define MEMORY_SIZE (IMAGE_BASE + IMAGE_SIZE + OPCODE_MAX_LENGTH)
+// k86 checks a block against guest memory through one page translation.
+#define PAGE_MASK 0xfff
+
+typedef struct {
+    int length;
+    int flow;
+    uint32_t target;
+} Decoded;
+
+static uint8_t* memory;
+static uint8_t* is_code;
+static uint8_t* is_leader;
+
+// Opcodes without a handler in instructions.c have length 0 and end the walk;
+// they are left to the interpreter.
+static Decoded decode(uint32_t address) {
+    Decoded d = {0, FLOW_UNKNOWN, 0};
+    const uint8_t* code = memory + address;
+
+    d.length = opcode_length(code);
+    if (d.length == 0) {
+        return d;
+    }
+
+    const OpcodeInfo* info = opcode_lookup(code);
+    const uint8_t* rel = code + d.length;
+    d.flow = info->flow;
+    if (info->operands[0] == OPERAND_JB) {
+        d.target = address + d.length + (int8_t) rel[-1];
+    } else if (info->operands[0] == OPERAND_JD) {
+        d.target = address + d.length + (int32_t) (rel[-4] | rel[-3] << 8 | rel[-2] << 16 | (uint32_t) rel[-1] << 24);
+    }
+    return d;
+}
+
+static int in_image(uint32_t address) {
+    return IMAGE_BASE <= address && address < IMAGE_BASE + IMAGE_SIZE;
+}
+
+static void discover(uint32_t entry) {
+    uint32_t* worklist = malloc(sizeof(uint32_t) * IMAGE_SIZE);
+    int top = 0;
+
+    is_leader[entry] = 1;
+    worklist[top++] = entry;
+    while (top > 0) {
+        uint32_t address = worklist[--top];
+        while (in_image(address) && !is_code[address]) {
+            Decoded d = decode(address);
+            if (d.flow == FLOW_UNKNOWN || !in_image(address + d.length - 1)
+                || (address & ~PAGE_MASK) != ((address + d.length - 1) & ~PAGE_MASK)) {
+                break;
+            }
+            if ((address & PAGE_MASK) == 0) {
+                is_leader[address] = 1;
+            }
+            is_code[address] = 1;
+
+            if (d.flow == FLOW_JUMP || d.flow == FLOW_BRANCH || d.flow == FLOW_CALL) {
+                if (in_image(d.target) && !is_leader[d.target]) {
+                    is_leader[d.target] = 1;
+                    worklist[top++] = d.target;
+                }
+            }
+            if (d.flow == FLOW_JUMP || d.flow == FLOW_RETURN) {
+                break;
+            }
+            address += d.length;
+            if (d.flow != FLOW_NEXT) {
+                // Fall-through of a jcc and the return site of a call start new blocks.
+                if (in_image(address) && !is_leader[address]) {
+                    is_leader[address] = 1;
+                    worklist[top++] = address;
+                }
+                break;
+            }
+        }
+    }
+    free(worklist);
+}
+
+// Emitted ahead of the blocks. k86_cpu_t mirrors the leading fields of
+// Emulator, and the ALU helpers compute flags as instructions.c does.
+static const char* const prelude =
+    "#include <stdint.h>\n"
+    "\n"
+    "typedef struct {\n"
+    "    uint32_t registers[8];\n"
+    "    uint32_t eflags;\n"
+    "    uint8_t* memory;\n"
+    "    uint32_t eip;\n"
+    "} k86_cpu_t;\n"
+    "\n"
+    "typedef void k86_op_t(k86_cpu_t*);\n"
+    "\n"
+    "typedef struct {\n"
+    "    k86_op_t** op;\n"
+    "    uint32_t (*read32)(k86_cpu_t*, uint32_t);\n"
+    "    void (*write32)(k86_cpu_t*, uint32_t, uint32_t);\n"
+    "    void (*spin_check)(k86_cpu_t*, uint32_t);\n"
+    "} k86_services_t;\n"
+    "\n"
+    "typedef struct {\n"
+    "    uint32_t eip;\n"
+    "    uint32_t count;\n"
+    "    uint32_t length;\n"
+    "    const uint8_t* code;\n"
+    "    void (*run)(k86_cpu_t*);\n"
+    "} k86_block_t;\n"
+    "\n"
+    "static const k86_services_t* k86;\n"
+    "\n"
+    "void k86_aot_bind(const k86_services_t* services) {\n"
+    "    k86 = services;\n"
+    "}\n"
+    "\n"
+    "#define R(index) (cpu->registers[index])\n"
+    "#define CF (1)\n"
+    "#define ZF (1 << 6)\n"
+    "#define SF (1 << 7)\n"
+    "#define OF (1 << 11)\n"
+    "\n"
+    "static inline void flags(k86_cpu_t* cpu, int carry, int overflow, uint32_t result) {\n"
+    "    cpu->eflags = (cpu->eflags & ~(CF | ZF | SF | OF)) | (carry ? CF : 0) | (result == 0 ? ZF : 0)\n"
+    "                  | (result >> 31 ? SF : 0) | (overflow ? OF : 0);\n"
+    "}\n"
+    "\n"
+    "static inline uint32_t add(k86_cpu_t* cpu, uint32_t a, uint32_t b) {\n"
+    "    uint32_t result;\n"
+    "    int32_t signed_result;\n"
+    "    int carry = __builtin_add_overflow(a, b, &result);\n"
+    "    flags(cpu, carry, __builtin_add_overflow((int32_t) a, (int32_t) b, &signed_result), result);\n"
+    "    return result;\n"
+    "}\n"
+    "\n"
+    "static inline uint32_t adc(k86_cpu_t* cpu, uint32_t a, uint32_t b) {\n"
+    "    uint32_t c = cpu->eflags & CF, sum, result;\n"
+    "    int32_t signed_sum, signed_result;\n"
+    "    int carry = __builtin_add_overflow(a, b, &sum) | __builtin_add_overflow(sum, c, &result);\n"
+    "    int overflow = __builtin_add_overflow((int32_t) a, (int32_t) b, &signed_sum)\n"
+    "                   ^ __builtin_add_overflow(signed_sum, (int32_t) c, &signed_result);\n"
+    "    flags(cpu, carry, overflow, result);\n"
+    "    return result;\n"
+    "}\n"
+    "\n"
+    "static inline uint32_t sub(k86_cpu_t* cpu, uint32_t a, uint32_t b) {\n"
+    "    uint32_t result;\n"
+    "    int32_t signed_result;\n"
+    "    int carry = __builtin_sub_overflow(a, b, &result);\n"
+    "    flags(cpu, carry, __builtin_sub_overflow((int32_t) a, (int32_t) b, &signed_result), result);\n"
+    "    return result;\n"
+    "}\n"
+    "\n"
+    "static inline uint32_t sbb(k86_cpu_t* cpu, uint32_t a, uint32_t b) {\n"
+    "    uint32_t c = cpu->eflags & CF, difference, result;\n"
+    "    int32_t signed_difference, signed_result;\n"
+    "    int carry = __builtin_sub_overflow(a, b, &difference) | __builtin_sub_overflow(difference, c, &result);\n"
+    "    int overflow = __builtin_sub_overflow((int32_t) a, (int32_t) b, &signed_difference)\n"
+    "                   ^ __builtin_sub_overflow(signed_difference, (int32_t) c, &signed_result);\n"
+    "    flags(cpu, carry, overflow, result);\n"
+    "    return result;\n"
+    "}\n"
+    "\n"
+    "static inline uint32_t and(k86_cpu_t* cpu, uint32_t a, uint32_t b) {\n"
+    "    flags(cpu, 0, 0, a & b);\n"
+    "    return a & b;\n"
+    "}\n"
+    "\n"
+    "static inline uint32_t or(k86_cpu_t* cpu, uint32_t a, uint32_t b) {\n"
+    "    flags(cpu, 0, 0, a | b);\n"
+    "    return a | b;\n"
+    "}\n"
+    "\n"
+    "static inline uint32_t xor(k86_cpu_t* cpu, uint32_t a, uint32_t b) {\n"
+    "    flags(cpu, 0, 0, a ^ b);\n"
+    "    return a ^ b;\n"
+    "}\n"
+    "\n"
+    "static inline uint32_t inc(k86_cpu_t* cpu, uint32_t a) {\n"
+    "    flags(cpu, cpu->eflags & CF, a == 0x7fffffffu, a + 1);\n"
+    "    return a + 1;\n"
+    "}\n"
+    "\n"
+    "static inline uint32_t dec(k86_cpu_t* cpu, uint32_t a) {\n"
+    "    flags(cpu, cpu->eflags & CF, a == 0x80000000u, a - 1);\n"
+    "    return a - 1;\n"
+    "}\n"
+    "\n";
+
+// The 00-3F operations and the 81/83 group members by index; cmp (7) is a
+// sub that does not write back.
+static const char* const alu_names[8] = {"add", "or", "adc", "sbb", "and", "sub", "xor", "sub"};
+
+// Conditions of the 70-7F branches k86 implements, over cpu->eflags.
+static const char* const conditions[16] = {
+    [0x0] = "cpu->eflags & OF",
+    [0x1] = "!(cpu->eflags & OF)",
+    [0x2] = "cpu->eflags & CF",
+    [0x3] = "!(cpu->eflags & CF)",
+    [0x4] = "cpu->eflags & ZF",
+    [0x5] = "!(cpu->eflags & ZF)",
+    [0x8] = "cpu->eflags & SF",
+    [0x9] = "!(cpu->eflags & SF)",
+    [0xC] = "!(cpu->eflags & SF) != !(cpu->eflags & OF)",
+    [0xE] = "(cpu->eflags & ZF) || !(cpu->eflags & SF) != !(cpu->eflags & OF)",
+};
+
+// The value cpu->eip holds at the point being emitted. Baked instructions
+// leave it behind; it is stored before a handler or a memory access reads it.
+static uint32_t block_eip;
+
+static void sync_eip(FILE* out, uint32_t eip) {
+    if (block_eip != eip) {
+        fprintf(out, "    cpu->eip = 0x%08xu;\n", eip);
+        block_eip = eip;
+    }
+}
+
+// Byte registers 4-7 are the high bytes of 0-3, as in get_register8.
+static void register8(char* text, int index) {
+    if (index < 4) {
+        sprintf(text, "(R(%d) & 0xff)", index);
+    } else {
+        sprintf(text, "(R(%d) >> 8 & 0xff)", index - 4);
+    }
+}
+
+static void emit_set_register8(FILE* out, int index, const char* value) {
+    if (index < 4) {
+        fprintf(out, "    R(%d) = (R(%d) & 0xffffff00u) | %s;\n", index, index, value);
+    } else {
+        fprintf(out, "    R(%d) = (R(%d) & 0xffff00ffu) | %s << 8;\n", index - 4, index - 4, value);
+    }
+}
+
+static void emit_alu(FILE* out, int operation, int destination, const char* a, const char* b) {
+    if (operation == 7) {
+        fprintf(out, "    sub(cpu, %s, %s);\n", a, b);
+    } else {
+        fprintf(out, "    R(%d) = %s(cpu, %s, %s);\n", destination, alu_names[operation], a, b);
+    }
+}
+
+// push32 and pop32: ESP moves before the store and after the load.
+static void emit_push(FILE* out, const char* value) {
+    fprintf(out, "    {\n        uint32_t value = %s;\n        R(4) -= 4;\n", value);
+    fprintf(out, "        k86->write32(cpu, R(4), value);\n    }\n");
+}
+
+static void emit_pop(FILE* out, const char* destination) {
+    fprintf(out, "    {\n        uint32_t value = k86->read32(cpu, R(4));\n        R(4) += 4;\n");
+    fprintf(out, "        %s = value;\n    }\n", destination);
+}
+
+// Backward short jumps are where the interpreter detects spinning.
+static void emit_jump(FILE* out, uint32_t address, uint32_t target, int spin, const char* indent) {
+    fprintf(out, "%scpu->eip = 0x%08xu;\n", indent, target);
+    if (spin) {
+        fprintf(out, "%sk86->spin_check(cpu, 0x%08xu);\n", indent, address);
+    }
+}
+
+// Register forms, stack operations and jumps become C with their operands
+// decoded; anything else calls its handler, which decodes at run time.
+static void emit_instruction(FILE* out, uint32_t address, Decoded d) {
+    const uint8_t* code = memory + address;
+    uint8_t op = code[0];
+    int mod = code[1] >> 6;
+    int reg = (code[1] >> 3) & 0x07;
+    int rm = code[1] & 0x07;
+    uint32_t next = address + d.length;
+    const uint8_t* imm = code + d.length - 4;
+    uint32_t imm32 = imm[0] | imm[1] << 8 | imm[2] << 16 | (uint32_t) imm[3] << 24;
+    uint8_t imm8 = code[d.length - 1];
+    char text[64];
+    char a[32];
+    char b[32];
+
+    disassemble(code, address, text, sizeof(text));
+    fprintf(out, "    // %08x: %s\n", address, text);
+
+    if (0xB8 <= op && op <= 0xBF) {
+        fprintf(out, "    R(%d) = 0x%08xu;\n", op & 0x07, imm32);
+    } else if (0xB0 <= op && op <= 0xB7) {
+        sprintf(a, "0x%02xu", imm8);
+        emit_set_register8(out, op & 0x07, a);
+    } else if ((op == 0x88 || op == 0x8A) && mod == 3) {
+        register8(a, op == 0x88 ? reg : rm);
+        emit_set_register8(out, op == 0x88 ? rm : reg, a);
+    } else if ((op == 0x89 || op == 0x8B) && mod == 3) {
+        fprintf(out, "    R(%d) = R(%d);\n", op == 0x89 ? rm : reg, op == 0x89 ? reg : rm);
+    } else if (0x40 <= op && op <= 0x4F) {
+        fprintf(out, "    R(%d) = %s(cpu, R(%d));\n", op & 0x07, op < 0x48 ? "inc" : "dec", op & 0x07);
+    } else if (op < 0x40 && (op & 0x07) == 1 && mod == 3) {
+        sprintf(a, "R(%d)", rm);
+        sprintf(b, "R(%d)", reg);
+        emit_alu(out, op >> 3, rm, a, b);
+    } else if (op < 0x40 && (op & 0x07) == 3 && mod == 3) {
+        sprintf(a, "R(%d)", reg);
+        sprintf(b, "R(%d)", rm);
+        emit_alu(out, op >> 3, reg, a, b);
+    } else if (op < 0x40 && (op & 0x07) == 5) {
+        sprintf(b, "0x%08xu", imm32);
+        emit_alu(out, op >> 3, 0, "R(0)", b);
+    } else if ((op == 0x81 || op == 0x83) && mod == 3) {
+        sprintf(a, "R(%d)", rm);
+        sprintf(b, "0x%08xu", op == 0x81 ? imm32 : (uint32_t) (int8_t) imm8);
+        emit_alu(out, reg, rm, a, b);
+    } else if (op == 0x85 && mod == 3) {
+        fprintf(out, "    and(cpu, R(%d), R(%d));\n", rm, reg);
+    } else if (op == 0xA9) {
+        fprintf(out, "    and(cpu, R(0), 0x%08xu);\n", imm32);
+    } else if ((0x50 <= op && op <= 0x57) || op == 0x68 || op == 0x6A) {
+        sync_eip(out, address);
+        if (op <= 0x57) {
+            sprintf(a, "R(%d)", op & 0x07);
+        } else {
+            // push_imm8 does not sign-extend.
+            sprintf(a, "0x%08xu", op == 0x68 ? imm32 : imm8);
+        }
+        emit_push(out, a);
+    } else if (0x58 <= op && op <= 0x5F) {
+        sync_eip(out, address);
+        sprintf(a, "R(%d)", op & 0x07);
+        emit_pop(out, a);
+    } else if (op == 0xC9) {
+        sync_eip(out, address);
+        fprintf(out, "    R(4) = R(5);\n");
+        emit_pop(out, "R(5)");
+    } else if (op == 0xE8) {
+        sync_eip(out, address);
+        sprintf(a, "0x%08xu", next);
+        emit_push(out, a);
+        emit_jump(out, address, d.target, 0, "    ");
+    } else if (op == 0xC3) {
+        sync_eip(out, address);
+        emit_pop(out, "cpu->eip");
+    } else if (op == 0xE9 || op == 0xEB) {
+        emit_jump(out, address, d.target, op == 0xEB && (int8_t) imm8 < 0, "    ");
+    } else if (0x70 <= op && op <= 0x7F && conditions[op & 0x0F] != NULL) {
+        fprintf(out, "    if (%s) {\n", conditions[op & 0x0F]);
+        emit_jump(out, address, d.target, (int8_t) imm8 < 0, "        ");
+        fprintf(out, "    } else {\n        cpu->eip = 0x%08xu;\n    }\n", next);
+    } else {
+        sync_eip(out, address);
+        fprintf(out, "    k86->op[0x%02X](cpu);\n", op);
+        block_eip = next;
+    }
+}
+
+// Returns the number of instructions; the block ends before address.
+static int emit_block(FILE* out, uint32_t start, uint32_t* end) {
+    uint32_t address = start;
+    int count = 0;
+
+    int flow;
+
+    fprintf(out, "static void block_%08x(k86_cpu_t* cpu) {\n", start);
+    block_eip = start;
+    do {
+        Decoded d = decode(address);
+        emit_instruction(out, address, d);
+        count++;
+        address += d.length;
+        flow = d.flow;
+    } while (flow == FLOW_NEXT && is_code[address] && !is_leader[address]);
+    if (flow == FLOW_NEXT) {
+        sync_eip(out, address);
+    }
+    fprintf(out, "}\n\n");
+
+    fprintf(out, "static const uint8_t code_%08x[] = {", start);
+    for (uint32_t i = start; i < address; i++) {
+        fprintf(out, "%s0x%02x,", (i - start) % 12 == 0 ? "\n    " : " ", memory[i]);
+    }
+    fprintf(out, "\n};\n\n");
+    *end = address;
+    return count;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        printf("usage: k86-aot filename output.c\n");
+        return 1;
+    }
+
+    memory = calloc(MEMORY_SIZE, 1);
+    is_code = calloc(MEMORY_SIZE, 1);
+    is_leader = calloc(MEMORY_SIZE, 1);
+
+    FILE* binary = fopen(argv[1], "rb");
+    if (binary == NULL) {
+        printf("Cannot open %s\n", argv[1]);
+        return 1;
+    }
+    size_t size = fread(memory + IMAGE_BASE, 1, IMAGE_SIZE, binary);
+    fclose(binary);
+
+    FILE* out = fopen(argv[2], "w");
+    if (out == NULL) {
+        printf("Cannot open %s\n", argv[2]);
+        return 1;
+    }
+
+    discover(IMAGE_BASE);
+
+    fprintf(out, "// Generated by k86-aot from %s. Do not edit.\n\n", argv[1]);
+    fputs(prelude, out);
+    fprintf(out, "const uint32_t k86_aot_image_hash = 0x%08xu;\n\n",
+            aot_image_hash(memory + IMAGE_BASE, size));
+
+    uint32_t* counts = calloc(IMAGE_SIZE, sizeof(uint32_t));
+    uint32_t* ends = calloc(IMAGE_SIZE, sizeof(uint32_t));
+    uint32_t blocks = 0;
+    for (uint32_t address = IMAGE_BASE; address < IMAGE_BASE + IMAGE_SIZE; address++) {
+        if (is_leader[address] && is_code[address]) {
+            counts[address - IMAGE_BASE] = emit_block(out, address, &ends[address - IMAGE_BASE]);
+            blocks++;
+        }
+    }
+
+    fprintf(out, "const k86_block_t k86_aot_blocks[] = {\n");
+    for (uint32_t address = IMAGE_BASE; address < IMAGE_BASE + IMAGE_SIZE; address++) {
+        if (counts[address - IMAGE_BASE] != 0) {
+            fprintf(out, "    {0x%08x, %u, %u, code_%08x, block_%08x},\n", address, counts[address - IMAGE_BASE],
+                    ends[address - IMAGE_BASE] - address, address, address);
+        }
+    }
+    fprintf(out, "};\n\n");
+    fprintf(out, "const uint32_t k86_aot_block_count = %u;\n", blocks);
+    fclose(out);
+
+    printf("%u blocks translated\n", blocks);
+    return 0;
+}
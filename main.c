@@ -4,6 +4,11 @@
 
 #include "emulator.h"
 #include "instructions.h"
+#include "aot.h"
+#include "gdbstub.h"
+#include "smp.h"
+#include "coverage.h"
+#include "replay.h"
 
 int opt_remove_at(int argc, char **argv, int index) {
     if (index < 0 || argc <= index) {
@@ -18,56 +23,173 @@ int opt_remove_at(int argc, char **argv, int index) {
     }
 }
 
+static int quiet = 0;
+static int aot_loaded = 0;
+
+static void run(Emulator* emu) {
+    for (;;) {
+        if (__atomic_load_n(&smp_stopped, __ATOMIC_RELAXED)) {
+            break;
+        }
+
+        const AotBlock* block = aot_loaded ? aot_lookup(emu) : NULL;
+        if (block != NULL) {
+            if (!quiet) {
+                printf("EIP = %X, Block of %u instructions\n", emu->eip, block->count);
+            }
+
+            block->run(emu);
+            emu->icount += block->count;
+            if (emu->eip == 0x00) {
+                printf("\nHALT\n");
+                break;
+            }
+            continue;
+        }
+
+        uint8_t code = get_code8(emu, 0);
+
+        if (!quiet) {
+            char text[64];
+            disassemble_at(emu, emu->eip, text, sizeof(text));
+            printf("EIP = %X, Code = %02X, %s\n", emu->eip, code, text);
+        }
+
+        if (instructions[code] == NULL) {
+            printf("\nNULL instruction: %x\n", code);
+            coverage_fault();
+            break;
+        }
+
+        instructions[code](emu);
+        emu->icount++;
+        if (emu->eip == 0x00) {
+            printf("\nHALT\n");
+            break;
+        }
+    }
+}
+
 int main(int argc, char **argv) {
     FILE* binary;
     Emulator* emu;
 
-    int quiet = 0;
+    int cpu_count = 1;
+    int coverage = 0;
+    const char* aot_path = NULL;
+    const char* gdb_address = NULL;
+    const char* replay_path = NULL;
+    int replay = REPLAY_OFF;
     for (int i = 1; i < argc;) {
         if (strcmp(argv[i], "-q") == 0) {
             quiet = 1;
             argc = opt_remove_at(argc, argv, i);
+        } else if (strcmp(argv[i], "-f") == 0) {
+            coverage = 1;
+            argc = opt_remove_at(argc, argv, i);
+        } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+            aot_path = argv[i + 1];
+            argc = opt_remove_at(argc, argv, i);
+            argc = opt_remove_at(argc, argv, i);
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            cpu_count = atoi(argv[i + 1]);
+            argc = opt_remove_at(argc, argv, i);
+            argc = opt_remove_at(argc, argv, i);
+        } else if ((strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "-p") == 0) && i + 1 < argc) {
+            replay = argv[i][1] == 'r' ? REPLAY_RECORD : REPLAY_PLAY;
+            replay_path = argv[i + 1];
+            argc = opt_remove_at(argc, argv, i);
+            argc = opt_remove_at(argc, argv, i);
+        } else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc) {
+            gdb_address = argv[i + 1];
+            argc = opt_remove_at(argc, argv, i);
+            argc = opt_remove_at(argc, argv, i);
         } else {
             i++;
         }
     }
 
-    if(argc != 2) {
-        printf("usage: k86 filename\n");
+    if(argc != 2 || cpu_count < 1) {
+        printf("usage: k86 [-q] [-f] [-c cpus] [-a translated.so] [-g port|path] [-r|-p log] filename\n");
+        return 1;
+    }
+
+    if (cpu_count > 1 && gdb_address != NULL) {
+        printf("The gdb stub supports a single CPU only\n");
+        return 1;
+    }
+
+    if (cpu_count > 1 && replay != REPLAY_OFF) {
+        printf("Record and replay support a single CPU only\n");
+        return 1;
+    }
+
+    // Single steps and breakpoint re-dispatches under the stub do not keep the
+    // instruction count a replay log is matched against.
+    if (gdb_address != NULL && replay != REPLAY_OFF) {
+        printf("Record and replay are not supported while debugging\n");
         return 1;
     }
 
     emu = create_emulator(MEMORY_SIZE, 0x7c00, 0x7c00);
 
+    init_instructions();
+
+    if (coverage) {
+        if (!coverage_init()) {
+            return 1;
+        }
+        coverage_instrument();
+        // The fuzzer rewrites the file before every run, so each child loads it.
+        coverage_fork_server();
+    }
+
     binary = fopen(argv[1], "rb");
     if(binary == NULL) {
         printf("Cannot open %s\n", argv[1]);
         return 1;
     }
-    fread(emu->memory + 0x7c00, 1, 0x200, binary);
+    size_t size = fread(emu->memory + 0x7c00, 1, 0x200, binary);
     fclose(binary);
 
-    init_instructions();
-
-    while (emu->eip < MEMORY_SIZE) {
-        uint8_t code = get_code8(emu, 0);
+    // Translated blocks call handlers directly and would run past int3 breakpoints,
+    // and only count instructions per block, which a replay log cannot match.
+    if (aot_path != NULL && gdb_address != NULL) {
+        printf("Translated blocks are disabled while debugging\n");
+    } else if (aot_path != NULL && replay != REPLAY_OFF) {
+        printf("Translated blocks are disabled while recording or replaying\n");
+    } else if (aot_path != NULL) {
+        aot_loaded = aot_load(aot_path, aot_image_hash(emu->memory + 0x7c00, size));
+    }
 
-        if (!quiet) {
-            printf("EIP = %X, Code = %02X\n", emu->eip, code);
+    if (gdb_address != NULL) {
+        if (!gdb_open(gdb_address)) {
+            return 1;
         }
+        gdb_attach(emu);
+    }
 
-        if (instructions[code] == NULL) {
-            printf("\nNULL instruction: %x\n", code);
-            break;
-        }
+    if (replay != REPLAY_OFF && !replay_open(replay_path, replay)) {
+        return 1;
+    }
 
-        instructions[code](emu);
-        if (emu->eip == 0x00) {
-            printf("\nHALT\n");
-            break;
+    if (cpu_count > 1) {
+        Emulator** emus = smp_start(emu, cpu_count, run);
+        run(emu);
+        smp_stop();
+        for (int i = 1; i < cpu_count; i++) {
+            printf("CPU %d\n", i);
+            dump_registers(emus[i]);
+            destroy_emulator(emus[i]);
         }
+        printf("CPU 0\n");
+        free(emus);
+    } else {
+        run(emu);
     }
 
+    replay_close();
+    gdb_exit(emu, 0);
     dump_registers(emu);
     destroy_emulator(emu);
     return 0;
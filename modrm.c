@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include "emulator.h"
 #include "modrm.h"
+#include "coverage.h"
 
 void parse_modrm(Emulator* emu, ModRM* modrm) {
     memset(modrm, 0, sizeof(ModRM));
@@ -34,6 +35,7 @@ uint32_t calc_memory_address(Emulator* emu, ModRM* modrm) {
     if (modrm->mod == 0) {
         if (modrm->rm == 4) {
             printf("Not implemented yet: mod=%d, rm=%d", modrm->mod, modrm->rm);
+            coverage_fault();
             exit(1);
         } else if (modrm->rm == 5) {
             return modrm->disp32;
@@ -43,6 +45,7 @@ uint32_t calc_memory_address(Emulator* emu, ModRM* modrm) {
     } else if (modrm->mod == 1) {
         if (modrm->rm == 4) {
             printf("Not implemented yet: mod=%d, rm=%d", modrm->mod, modrm->rm);
+            coverage_fault();
             exit(1);
         } else {
             return get_register32(emu, modrm->rm) + modrm->disp8;
@@ -50,12 +53,14 @@ uint32_t calc_memory_address(Emulator* emu, ModRM* modrm) {
     } else if (modrm->mod == 2) {
         if (modrm->rm == 4) {
             printf("Not implemented yet: mod=%d, rm=%d", modrm->mod, modrm->rm);
+            coverage_fault();
             exit(1);
         } else {
             return get_register32(emu, modrm->rm) + modrm->disp32;
         }
     } else {
         printf("Not implemented yet: mod=%d, rm=%d", modrm->mod, modrm->rm);
+        coverage_fault();
         exit(1);
     }
 }
@@ -17,12 +17,13 @@ typedef struct {
 
     uint8_t sib;
     union {
-        uint8_t disp8;
+        int8_t disp8;
         uint32_t disp32;
     };
 } ModRM;
 
 void parse_modrm(Emulator* emu, ModRM* modRm);
+uint32_t calc_memory_address(Emulator* emu, ModRM* modrm);
 
 uint8_t get_r8(Emulator* emu, ModRM* modRm);
 void set_r8(Emulator*, ModRM*, uint8_t);
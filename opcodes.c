@@ -0,0 +1,190 @@
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "opcodes.h"
+
+static const char* const registers8[8] = {"al", "cl", "dl", "bl", "ah", "ch", "dh", "bh"};
+static const char* const registers32[8] = {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi"};
+
+// Prefix and escape are folded in as 0/1 offsets, and a missing ModRM or an
+// unknown opcode masks its part of the sum, so nothing here branches. A SIB
+// byte, or lock before an opcode that cannot take it or with a register
+// operand, makes the whole instruction invalid.
+int opcode_length(const uint8_t* code) {
+    int prefix = code[0] == 0xF0;
+    int escape = code[prefix] == 0x0F;
+    const uint8_t* p = code + prefix + escape;
+    uint8_t entry = opcode_lengths[prefix][escape << 8 | p[0]][(p[1] >> 3) & 0x07];
+    int has_modrm = entry >> 7;
+    int modrm = modrm_lengths[p[1]];
+    int length = prefix + escape + (entry & 0x7f) + (modrm & -has_modrm);
+    int valid = (entry != 0) & ((modrm != 0) | !has_modrm) & !(prefix & ((p[1] >> 6) == 3));
+    return length & -valid;
+}
+
+const OpcodeInfo* opcode_lookup(const uint8_t* code) {
+    int prefix = code[0] == 0xF0;
+    int escape = code[prefix] == 0x0F;
+    const uint8_t* p = code + prefix + escape;
+    const OpcodeInfo* info = &opcode_info[escape << 8 | p[0]];
+    if (info->group != 0) {
+        info = &group_info[info->group][(p[1] >> 3) & 0x07];
+    }
+    return info;
+}
+
+typedef struct {
+    char* text;
+    size_t size;
+    size_t length;
+} Output;
+
+static void put(Output* out, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    size_t room = out->length < out->size ? out->size - out->length : 0;
+    int n = vsnprintf(out->text + out->length, room, format, args);
+    va_end(args);
+    if (n > 0) {
+        out->length += n;
+    }
+}
+
+static void put_hex(Output* out, int32_t value, int sign) {
+    if (sign && value < 0) {
+        put(out, "-0x%x", (uint32_t) -(int64_t) value);
+    } else {
+        put(out, "0x%x", (uint32_t) value);
+    }
+}
+
+static void put_memory(Output* out, const uint8_t* modrm, const char* width) {
+    int mod = modrm[0] >> 6;
+    int rm = modrm[0] & 0x07;
+    const uint8_t* disp = modrm + 1;
+    int registers = 1;
+
+    put(out, "%s[", width);
+    if (mod == 0 && rm == 5) {
+        registers = 0;
+        mod = 2;
+    } else {
+        put(out, "%s", registers32[rm]);
+    }
+
+    int32_t value = 0;
+    if (mod == 1) {
+        value = (int8_t) disp[0];
+    } else if (mod == 2) {
+        value = disp[0] | disp[1] << 8 | disp[2] << 16 | (uint32_t) disp[3] << 24;
+    }
+    if (!registers) {
+        put_hex(out, value, 0);
+    } else if (mod != 0) {
+        put(out, value < 0 ? "" : "+");
+        put_hex(out, value, 1);
+    }
+    put(out, "]");
+}
+
+static void put_rm(Output* out, const uint8_t* modrm, const char* const* registers, const char* width) {
+    if ((modrm[0] >> 6) == 3) {
+        put(out, "%s", registers[modrm[0] & 0x07]);
+    } else {
+        put_memory(out, modrm, width);
+    }
+}
+
+// Writes Intel syntax for the instruction at code, which was fetched from
+// address, and returns its length; 0 for an opcode k86 does not execute.
+int disassemble(const uint8_t* code, uint32_t address, char* text, size_t size) {
+    Output out = {text, size, 0};
+    int length = opcode_length(code);
+    const OpcodeInfo* info = opcode_lookup(code);
+
+    if (size > 0) {
+        text[0] = '\0';
+    }
+    if (length == 0) {
+        put(&out, "(bad)");
+        return 0;
+    }
+
+    int prefix = code[0] == 0xF0;
+    int escape = code[prefix] == 0x0F;
+    const uint8_t* opcode = code + prefix + escape;
+    const uint8_t* modrm = opcode + 1;
+    const uint8_t* imm = modrm + ((opcode_lengths[prefix][escape << 8 | opcode[0]][(modrm[0] >> 3) & 0x07] >> 7)
+                                  ? modrm_lengths[modrm[0]] : 0);
+    int reg = (modrm[0] >> 3) & 0x07;
+
+    put(&out, "%s%s", prefix ? "lock " : "", info->mnemonic);
+    for (int i = 0; i < 3 && info->operands[i] != OPERAND_NONE; i++) {
+        put(&out, i == 0 ? " " : ", ");
+        switch (info->operands[i]) {
+            case OPERAND_EB:
+                put_rm(&out, modrm, registers8, "byte ");
+                break;
+            case OPERAND_EV:
+                put_rm(&out, modrm, registers32, "dword ");
+                break;
+            case OPERAND_GB:
+                put(&out, "%s", registers8[reg]);
+                break;
+            case OPERAND_GV:
+                put(&out, "%s", registers32[reg]);
+                break;
+            case OPERAND_ZB:
+                put(&out, "%s", registers8[opcode[0] & 0x07]);
+                break;
+            case OPERAND_ZV:
+                put(&out, "%s", registers32[opcode[0] & 0x07]);
+                break;
+            case OPERAND_RD:
+                put(&out, "%s", registers32[modrm[0] & 0x07]);
+                break;
+            case OPERAND_CR:
+                put(&out, "cr%d", reg);
+                break;
+            case OPERAND_M:
+                put_memory(&out, modrm, "");
+                break;
+            case OPERAND_AL:
+                put(&out, "al");
+                break;
+            case OPERAND_EAX:
+                put(&out, "eax");
+                break;
+            case OPERAND_CL:
+                put(&out, "cl");
+                break;
+            case OPERAND_DX:
+                put(&out, "dx");
+                break;
+            case OPERAND_ONE:
+                put(&out, "1");
+                break;
+            case OPERAND_IB:
+                put_hex(&out, imm[0], 0);
+                imm += 1;
+                break;
+            case OPERAND_IBX:
+                put_hex(&out, (int8_t) imm[0], 1);
+                imm += 1;
+                break;
+            case OPERAND_ID:
+                put_hex(&out, imm[0] | imm[1] << 8 | imm[2] << 16 | (uint32_t) imm[3] << 24, 0);
+                imm += 4;
+                break;
+            case OPERAND_JB:
+                put_hex(&out, address + length + (int8_t) imm[0], 0);
+                imm += 1;
+                break;
+            case OPERAND_JD:
+                put_hex(&out, address + length + (imm[0] | imm[1] << 8 | imm[2] << 16 | (uint32_t) imm[3] << 24), 0);
+                imm += 4;
+                break;
+        }
+    }
+    return length;
+}
@@ -0,0 +1,113 @@
+#ifndef K86_OPCODES_H
+#define K86_OPCODES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Buffer size the decoder may read from: the longest instruction k86 knows
+// plus the bytes it peeks past a short one.
+#define OPCODE_MAX_LENGTH 16
+
+// Opcodes after 0x0F are numbered from 0x100.
+#define OPCODE_COUNT 512
+
+enum Operand {
+    OPERAND_NONE,
+    OPERAND_EB,     // r/m8
+    OPERAND_EV,     // r/m32
+    OPERAND_GB,     // r8 in the ModRM reg field
+    OPERAND_GV,     // r32 in the ModRM reg field
+    OPERAND_ZB,     // r8 in the low bits of the opcode
+    OPERAND_ZV,     // r32 in the low bits of the opcode
+    OPERAND_RD,     // r32 in the ModRM rm field
+    OPERAND_CR,     // control register in the ModRM reg field
+    OPERAND_M,      // memory, address only
+    OPERAND_AL,
+    OPERAND_EAX,
+    OPERAND_CL,
+    OPERAND_DX,
+    OPERAND_ONE,
+    OPERAND_IB,     // imm8
+    OPERAND_IBX,    // imm8 sign-extended to 32 bits
+    OPERAND_ID,     // imm32
+    OPERAND_JB,     // rel8
+    OPERAND_JD,     // rel32
+    OPERAND_COUNT
+};
+
+// Operand forms named in opcodes.def. GROUP takes its operands from the
+// ModRM reg field, ESCAPE and PREFIX from the byte that follows.
+#define OPCODE_FORMS(X) \
+    X(NONE, NONE, NONE, NONE) \
+    X(GROUP, NONE, NONE, NONE) \
+    X(ESCAPE, NONE, NONE, NONE) \
+    X(PREFIX, NONE, NONE, NONE) \
+    X(EB, EB, NONE, NONE) \
+    X(EV, EV, NONE, NONE) \
+    X(M, M, NONE, NONE) \
+    X(ZV, ZV, NONE, NONE) \
+    X(IB, IB, NONE, NONE) \
+    X(ID, ID, NONE, NONE) \
+    X(JB, JB, NONE, NONE) \
+    X(JD, JD, NONE, NONE) \
+    X(EB_GB, EB, GB, NONE) \
+    X(EV_GV, EV, GV, NONE) \
+    X(GB_EB, GB, EB, NONE) \
+    X(GV_EV, GV, EV, NONE) \
+    X(EB_IB, EB, IB, NONE) \
+    X(EV_IB, EV, IB, NONE) \
+    X(EV_IBX, EV, IBX, NONE) \
+    X(EV_ID, EV, ID, NONE) \
+    X(EB_ONE, EB, ONE, NONE) \
+    X(EV_ONE, EV, ONE, NONE) \
+    X(EB_CL, EB, CL, NONE) \
+    X(EV_CL, EV, CL, NONE) \
+    X(ZB_IB, ZB, IB, NONE) \
+    X(ZV_ID, ZV, ID, NONE) \
+    X(AL_IB, AL, IB, NONE) \
+    X(EAX_ID, EAX, ID, NONE) \
+    X(AL_DX, AL, DX, NONE) \
+    X(DX_AL, DX, AL, NONE) \
+    X(RD_CR, RD, CR, NONE) \
+    X(CR_RD, CR, RD, NONE) \
+    X(GV_EV_IBX, GV, EV, IBX) \
+    X(GV_EV_ID, GV, EV, ID)
+
+enum OpcodeForm {
+#define FORM_ENUM(name, first, second, third) FORM_ ## name,
+    OPCODE_FORMS(FORM_ENUM)
+#undef FORM_ENUM
+    FORM_COUNT
+};
+
+enum Flow {
+    FLOW_UNKNOWN, FLOW_NEXT, FLOW_JUMP, FLOW_BRANCH, FLOW_CALL, FLOW_RETURN
+};
+
+typedef struct {
+    const char* mnemonic;
+    uint8_t operands[3];
+    uint8_t flow;
+    uint8_t group;
+} OpcodeInfo;
+
+// Generated from opcodes.def at build time. An opcode with a group indexes
+// group_info by its ModRM reg field. opcode_lengths holds, per lock prefix,
+// opcode and reg field, the opcode byte plus immediates, with bit 7 set when
+// a ModRM follows; 0 means k86 has no handler for it. modrm_lengths is 0 for
+// a ModRM with a SIB byte, which k86 does not decode.
+extern const OpcodeInfo opcode_info[OPCODE_COUNT];
+extern const OpcodeInfo group_info[][8];
+extern const uint8_t opcode_lengths[2][OPCODE_COUNT][8];
+extern const uint8_t modrm_lengths[256];
+
+int opcode_length(const uint8_t* code);
+const OpcodeInfo* opcode_lookup(const uint8_t* code);
+int disassemble(const uint8_t* code, uint32_t address, char* text, size_t size);
+
+// Implemented in paging.c, which reads guest memory through the page tables.
+struct Emulator;
+int fetch_code(struct Emulator* emu, uint32_t address, uint8_t* code);
+int disassemble_at(struct Emulator* emu, uint32_t address, char* text, size_t size);
+
+#endif //K86_OPCODES_H
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "paging.h"
+#include "coverage.h"
+
+#define PTE_PRESENT (1)
+#define PTE_WRITABLE (1 << 1)
+#define PTE_ACCESSED (1 << 5)
+#define PTE_DIRTY (1 << 6)
+#define PDE_PAGE_SIZE (1 << 7)
+#define PTE_ADDRESS 0xfffff000
+
+#define NO_PAGE 0xffffffff
+
+static uint32_t* physical32(Emulator* emu, uint32_t address) {
+    if (address > MEMORY_SIZE - 4) {
+        return NULL;
+    }
+    return (uint32_t*) (emu->memory + address);
+}
+
+// Returns the physical page of a linear address, or NO_PAGE. Accessed and
+// dirty bits are only updated when the access is real.
+static uint32_t walk(Emulator* emu, uint32_t address, int access, int update) {
+    if (!(emu->cr0 & CR0_PG)) {
+        return address & PTE_ADDRESS;
+    }
+
+    uint32_t* pde = physical32(emu, (emu->cr3 & PTE_ADDRESS) + (address >> 22) * 4);
+    if (pde == NULL || !(*pde & PTE_PRESENT)) {
+        return NO_PAGE;
+    }
+    if (*pde & PDE_PAGE_SIZE) {
+        printf("Not implemented yet: 4MiB pages unsupported: address=%08x, eip=%08x\n", address, emu->eip);
+        coverage_fault();
+        exit(1);
+    }
+    uint32_t* pte = physical32(emu, (*pde & PTE_ADDRESS) + ((address >> PAGE_SHIFT) & 0x3ff) * 4);
+    if (pte == NULL || !(*pte & PTE_PRESENT)) {
+        return NO_PAGE;
+    }
+    if (access == ACCESS_WRITE && (emu->cr0 & CR0_WP) && !(*pde & *pte & PTE_WRITABLE)) {
+        return NO_PAGE;
+    }
+
+    if (update) {
+        *pde |= PTE_ACCESSED;
+        *pte |= PTE_ACCESSED | (access == ACCESS_WRITE ? PTE_DIRTY : 0);
+    }
+    return *pte & PTE_ADDRESS;
+}
+
+uint8_t* tlb_fill(Emulator* emu, uint32_t address, int access) {
+    uint32_t page = walk(emu, address, access, 1);
+    if (page == NO_PAGE) {
+        emu->cr2 = address;
+        printf("Page fault: address=%08x, eip=%08x\n", address, emu->eip);
+        coverage_fault();
+        exit(1);
+    }
+    if (page >= MEMORY_SIZE) {
+        printf("Memory access out of range: address=%08x, eip=%08x\n", address, emu->eip);
+        coverage_fault();
+        exit(1);
+    }
+
+    uint32_t index = (address >> PAGE_SHIFT) & (TLB_SIZE - 1);
+    emu->tlb_tag[access][index] = address >> PAGE_SHIFT;
+    emu->tlb_page[access][index] = emu->memory + page;
+    return emu->memory + page;
+}
+
+void tlb_flush(Emulator* emu) {
+    for (int access = 0; access < ACCESS_COUNT; access++) {
+        for (int i = 0; i < TLB_SIZE; i++) {
+            emu->tlb_tag[access][i] = NO_PAGE;
+        }
+    }
+    // Spin analyses read the loop body through the old mappings too.
+    memset(emu->spin.loops, 0, sizeof(emu->spin.loops));
+}
+
+void tlb_flush_page(Emulator* emu, uint32_t address) {
+    uint32_t index = (address >> PAGE_SHIFT) & (TLB_SIZE - 1);
+    for (int access = 0; access < ACCESS_COUNT; access++) {
+        if (emu->tlb_tag[access][index] == address >> PAGE_SHIFT) {
+            emu->tlb_tag[access][index] = NO_PAGE;
+        }
+    }
+}
+
+// Translates for the debugger: never faults and leaves the TLB alone.
+uint8_t* probe_memory(Emulator* emu, uint32_t address) {
+    uint32_t page = walk(emu, address, ACCESS_READ, 0);
+    if (page == NO_PAGE || page >= MEMORY_SIZE) {
+        return NULL;
+    }
+    return emu->memory + page + (address & PAGE_MASK);
+}
+
+// Reads through the page tables without faulting or setting accessed bits;
+// bytes that are not mapped read as 0.
+int fetch_code(Emulator* emu, uint32_t address, uint8_t* code) {
+    int i = 0;
+    while (i < OPCODE_MAX_LENGTH) {
+        uint8_t* p = probe_memory(emu, address + i);
+        int n = PAGE_SIZE - ((address + i) & PAGE_MASK);
+        if (n > OPCODE_MAX_LENGTH - i) {
+            n = OPCODE_MAX_LENGTH - i;
+        }
+        if (p == NULL) {
+            memset(code + i, 0, n);
+        } else {
+            memcpy(code + i, p, n);
+        }
+        i += n;
+    }
+    return opcode_length(code);
+}
+
+int disassemble_at(Emulator* emu, uint32_t address, char* text, size_t size) {
+    uint8_t code[OPCODE_MAX_LENGTH];
+    fetch_code(emu, address, code);
+    return disassemble(code, address, text, size);
+}
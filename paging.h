@@ -0,0 +1,9 @@
+#ifndef K86_PAGING_H
+#define K86_PAGING_H
+
+#include "emulator.h"
+
+void tlb_flush_page(Emulator* emu, uint32_t address);
+uint8_t* probe_memory(Emulator* emu, uint32_t address);
+
+#endif //K86_PAGING_H
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "replay.h"
+
+// A log is the header followed by one record per port read:
+// LEB128 instruction count since the previous record, LEB128 port, value.
+static const char REPLAY_MAGIC[4] = {'K', '8', '6', 'R'};
+#define REPLAY_VERSION 1
+
+int replay_mode = REPLAY_OFF;
+
+static FILE* replay_file;
+static uint64_t replay_last_icount;
+
+// Replay reads one record ahead so that the next event time is known.
+static int next_valid;
+static uint64_t next_icount;
+static uint64_t next_port;
+static int next_value;
+
+static void write_uleb128(uint64_t value) {
+    do {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        putc(value ? byte | 0x80 : byte, replay_file);
+    } while (value);
+}
+
+static int read_uleb128(uint64_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = getc(replay_file);
+        if (byte == EOF) {
+            return 0;
+        }
+        *value |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void read_next(void) {
+    uint64_t delta;
+    next_valid = read_uleb128(&delta) && read_uleb128(&next_port) && (next_value = getc(replay_file)) != EOF;
+    next_icount = replay_last_icount + delta;
+}
+
+int replay_open(const char* path, int mode) {
+    replay_file = fopen(path, mode == REPLAY_RECORD ? "wb" : "rb");
+    if (replay_file == NULL) {
+        printf("Cannot open %s\n", path);
+        return 0;
+    }
+
+    if (mode == REPLAY_RECORD) {
+        fwrite(REPLAY_MAGIC, 1, sizeof(REPLAY_MAGIC), replay_file);
+        putc(REPLAY_VERSION, replay_file);
+    } else {
+        char magic[sizeof(REPLAY_MAGIC)];
+        if (fread(magic, 1, sizeof(magic), replay_file) != sizeof(magic)
+            || memcmp(magic, REPLAY_MAGIC, sizeof(magic)) != 0
+            || getc(replay_file) != REPLAY_VERSION) {
+            printf("%s is not a k86 replay log\n", path);
+            fclose(replay_file);
+            return 0;
+        }
+    }
+
+    replay_mode = mode;
+    replay_last_icount = 0;
+    if (mode == REPLAY_PLAY) {
+        read_next();
+    }
+    return 1;
+}
+
+void replay_close(void) {
+    if (replay_file != NULL) {
+        fclose(replay_file);
+        replay_file = NULL;
+    }
+    replay_mode = REPLAY_OFF;
+}
+
+void replay_record_in8(Emulator* emu, uint16_t address, uint8_t value) {
+    write_uleb128(emu->icount - replay_last_icount);
+    write_uleb128(address);
+    putc(value, replay_file);
+    replay_last_icount = emu->icount;
+}
+
+uint8_t replay_play_in8(Emulator* emu, uint16_t address) {
+    if (!next_valid) {
+        printf("\nReplay log ended at instruction %llu\n", (unsigned long long) emu->icount);
+        exit(1);
+    }
+    if (next_icount != emu->icount || next_port != address) {
+        printf("\nReplay diverged at instruction %llu: port %04x read, log has port %04x at instruction %llu\n",
+               (unsigned long long) emu->icount, address, (unsigned) next_port, (unsigned long long) next_icount);
+        exit(1);
+    }
+
+    uint8_t value = next_value;
+    replay_last_icount = next_icount;
+    read_next();
+    return value;
+}
+
+int replay_next_event(uint64_t* icount) {
+    *icount = next_icount;
+    return next_valid;
+}
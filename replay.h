@@ -0,0 +1,19 @@
+#ifndef K86_REPLAY_H
+#define K86_REPLAY_H
+
+#include "emulator.h"
+
+enum ReplayMode {
+    REPLAY_OFF, REPLAY_RECORD, REPLAY_PLAY
+};
+
+extern int replay_mode;
+
+int replay_open(const char* path, int mode);
+void replay_close(void);
+
+void replay_record_in8(Emulator* emu, uint16_t address, uint8_t value);
+uint8_t replay_play_in8(Emulator* emu, uint16_t address);
+int replay_next_event(uint64_t* icount);
+
+#endif //K86_REPLAY_H
@@ -0,0 +1,56 @@
+#include <poll.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "serial.h"
+
+#define LSR_DATA_READY (1)
+#define LSR_THR_EMPTY (1 << 5)
+#define LSR_TRANSMITTER_EMPTY (1 << 6)
+
+// stdin is read a byte at a time without stdio buffering, so that poll()
+// tells the truth about whether a byte is waiting.
+static int pending = -1;
+static int end_of_input;
+
+static void receive(void) {
+    uint8_t c;
+    fflush(stdout);
+    if (read(STDIN_FILENO, &c, 1) == 1) {
+        pending = c;
+    } else {
+        end_of_input = 1;
+    }
+}
+
+static int poll_input(int timeout) {
+    struct pollfd fd = {STDIN_FILENO, POLLIN, 0};
+    return poll(&fd, 1, timeout) > 0;
+}
+
+uint8_t serial_read(void) {
+    if (pending < 0 && !end_of_input) {
+        receive();
+    }
+    if (pending < 0) {
+        return 0xff;
+    }
+    uint8_t value = pending;
+    pending = -1;
+    return value;
+}
+
+uint8_t serial_line_status(void) {
+    if (pending < 0 && !end_of_input && poll_input(0)) {
+        receive();
+    }
+    int ready = pending >= 0 || end_of_input;
+    return LSR_THR_EMPTY | LSR_TRANSMITTER_EMPTY | (ready ? LSR_DATA_READY : 0);
+}
+
+// Blocks the host thread until the next byte, or the end of input, arrives.
+void serial_wait(void) {
+    if (pending < 0 && !end_of_input && poll_input(-1)) {
+        receive();
+    }
+}
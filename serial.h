@@ -0,0 +1,13 @@
+#ifndef K86_SERIAL_H
+#define K86_SERIAL_H
+
+#include <stdint.h>
+
+#define SERIAL_DATA_PORT 0x03f8
+#define SERIAL_LINE_STATUS_PORT 0x03fd
+
+uint8_t serial_read(void);
+uint8_t serial_line_status(void);
+void serial_wait(void);
+
+#endif //K86_SERIAL_H
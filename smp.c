@@ -0,0 +1,76 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "smp.h"
+
+typedef struct {
+    Emulator* emu;
+    pthread_t thread;
+    int started;
+} Vcpu;
+
+static Vcpu* vcpus;
+static int vcpu_count;
+static run_func_t* vcpu_run;
+int smp_stopped;
+static pthread_mutex_t startup_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t startup_cond = PTHREAD_COND_INITIALIZER;
+
+static void* vcpu_main(void* arg) {
+    Vcpu* vcpu = arg;
+
+    pthread_mutex_lock(&startup_lock);
+    while (!vcpu->started && !smp_stopped) {
+        pthread_cond_wait(&startup_cond, &startup_lock);
+    }
+    int started = vcpu->started;
+    pthread_mutex_unlock(&startup_lock);
+
+    if (started) {
+        vcpu_run(vcpu->emu);
+    }
+    return NULL;
+}
+
+// Secondary CPUs share the memory of the bootstrap CPU and wait for a
+// startup IPI on their own host thread.
+Emulator** smp_start(Emulator* bsp, int count, run_func_t* run) {
+    Emulator** emus = malloc(sizeof(Emulator*) * count);
+    vcpus = calloc(count, sizeof(Vcpu));
+    vcpu_count = count;
+    vcpu_run = run;
+
+    emus[0] = bsp;
+    vcpus[0].emu = bsp;
+    vcpus[0].started = 1;
+    for (int i = 1; i < count; i++) {
+        emus[i] = create_vcpu(bsp, i);
+        vcpus[i].emu = emus[i];
+        pthread_create(&vcpus[i].thread, NULL, vcpu_main, &vcpus[i]);
+    }
+    return emus;
+}
+
+void smp_startup_ipi(Emulator* emu, uint8_t vector) {
+    pthread_mutex_lock(&startup_lock);
+    for (int i = 0; i < vcpu_count; i++) {
+        if (!vcpus[i].started && vcpus[i].emu != emu) {
+            vcpus[i].emu->eip = (uint32_t) vector << 12;
+            vcpus[i].started = 1;
+        }
+    }
+    pthread_cond_broadcast(&startup_cond);
+    pthread_mutex_unlock(&startup_lock);
+}
+
+// Stops the secondary CPUs, started or not, and waits for their threads.
+void smp_stop(void) {
+    pthread_mutex_lock(&startup_lock);
+    __atomic_store_n(&smp_stopped, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&startup_cond);
+    pthread_mutex_unlock(&startup_lock);
+
+    for (int i = 1; i < vcpu_count; i++) {
+        pthread_join(vcpus[i].thread, NULL);
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef K86_SMP_H
+#define K86_SMP_H
+
+#include "emulator.h"
+
+// A minimal local APIC on I/O ports: reading APIC_ID_PORT gives the CPU
+// number, writing a vector to APIC_ICR_PORT sends a startup IPI that starts
+// every waiting secondary CPU at vector << 12.
+#define APIC_ID_PORT 0xfee0
+#define APIC_ICR_PORT 0xfee3
+
+typedef void run_func_t(Emulator*);
+
+// Set by smp_stop once the bootstrap CPU has halted; running secondary CPUs
+// leave run() at their next instruction.
+extern int smp_stopped;
+
+Emulator** smp_start(Emulator* bsp, int count, run_func_t* run);
+void smp_startup_ipi(Emulator* emu, uint8_t vector);
+void smp_stop(void);
+
+#endif //K86_SMP_H
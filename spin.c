@@ -0,0 +1,112 @@
+#include <sched.h>
+#include <time.h>
+
+#include "spin.h"
+#include "io.h"
+#include "replay.h"
+#include "opcodes.h"
+
+enum SpinKind {
+    SPIN_NONE, SPIN_PORT, SPIN_MEMORY
+};
+
+// Virtual time, in instructions, credited for each second the host spends
+// waiting for a device instead of running a polling loop.
+#define INSTRUCTIONS_PER_SECOND 100000000ULL
+
+// A body made only of port reads, loads, moves, compares, tests and short jumps can change
+// nothing but registers and flags, so an iteration that leaves those as they
+// were will repeat until what it reads changes.
+static int analyse(Emulator* emu, uint32_t head, uint32_t branch) {
+    int reads_port = 0;
+    int reads_memory = 0;
+    uint32_t address = head;
+
+    while (address < branch) {
+        uint8_t code[OPCODE_MAX_LENGTH];
+        int length = fetch_code(emu, address, code);
+        if (length == 0) {
+            return SPIN_NONE;
+        }
+
+        uint8_t op = code[0];
+        if (op == 0xEC) {
+            reads_port = 1;
+        } else if ((0x38 <= op && op <= 0x3B) || op == 0x84 || op == 0x85 || op == 0x8A || op == 0x8B) {
+            reads_memory |= (code[1] >> 6) != 3;
+        } else if (!(op == 0x3C || op == 0x3D || op == 0xA8 || op == 0xA9 || op == 0xEB
+                     || (0x70 <= op && op <= 0x7F) || (0xB0 <= op && op <= 0xBF))) {
+            return SPIN_NONE;
+        }
+        address += length;
+    }
+
+    if (address != branch) {
+        return SPIN_NONE;
+    }
+    // A loop that also polls memory may be released by another CPU, so it
+    // must not block waiting for the device alone.
+    return reads_memory ? SPIN_MEMORY : reads_port ? SPIN_PORT : SPIN_NONE;
+}
+
+static int same_state(Emulator* emu, SpinState* spin) {
+    return emu->eflags == spin->eflags
+           && memcmp(emu->registers, spin->registers, sizeof(emu->registers)) == 0;
+}
+
+static void snapshot(Emulator* emu, SpinState* spin) {
+    spin->icount = emu->icount;
+    spin->eflags = emu->eflags;
+    memcpy(spin->registers, emu->registers, sizeof(emu->registers));
+}
+
+// Skips whole iterations up to the next device event, as if they had run.
+static void fast_forward(Emulator* emu, int kind, uint64_t length) {
+    if (kind == SPIN_MEMORY) {
+        // Only another CPU can change the location.
+        sched_yield();
+        return;
+    }
+
+    if (replay_mode == REPLAY_PLAY) {
+        uint64_t next;
+        if (replay_next_event(&next) && next > emu->icount) {
+            emu->icount += (next - emu->icount) / length * length;
+        }
+        return;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!io_wait_event(get_register32(emu, EDX) & 0xffff)) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    uint64_t elapsed = (uint64_t) (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+    uint64_t iterations = elapsed * (INSTRUCTIONS_PER_SECOND / 1000000) / 1000 / length;
+    emu->icount += (iterations ? iterations : 1) * length;
+}
+
+// Called on every taken backward short jump, with EIP already at the target.
+void spin_check(Emulator* emu, uint32_t branch) {
+    SpinState* spin = &emu->spin;
+    SpinLoop* loop = &spin->loops[branch & (SPIN_CACHE_SIZE - 1)];
+
+    if (loop->branch != branch || loop->head != emu->eip) {
+        loop->branch = branch;
+        loop->head = emu->eip;
+        loop->kind = analyse(emu, emu->eip, branch);
+    }
+
+    if (loop->kind == SPIN_NONE) {
+        // Whatever ran since the last snapshot was not a single spin loop.
+        spin->branch = branch;
+        return;
+    }
+    if (spin->branch == branch && same_state(emu, spin)) {
+        fast_forward(emu, loop->kind, emu->icount - spin->icount);
+    }
+    spin->branch = branch;
+    snapshot(emu, spin);
+}
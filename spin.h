@@ -0,0 +1,8 @@
+#ifndef K86_SPIN_H
+#define K86_SPIN_H
+
+#include "emulator.h"
+
+void spin_check(Emulator* emu, uint32_t branch);
+
+#endif //K86_SPIN_H